@@ -1,416 +1,1619 @@
-/*
-#######################################################################
-# Copyright (C)                                                       #
-# 2018 Donghai He(gsutilml@gmail.com)                                 #
-# 2018 Yuanyao Liu                                                    #
-# Permission given to modify the code as long as you keep this        #
-# declaration at the top                                              #
-#######################################################################
-
-#######################################################################
-# Copyright (C)                                                       #
-# 2016 - 2018 Shangtong Zhang(zhangshangtong.cpp@gmail.com)           #
-# 2016 Jan Hakenberg(jan.hakenberg@gmail.com)                         #
-# 2016 Tian Jun(tianjun.cpp@gmail.com)                                #
-# 2016 Kenta Shimada(hyperkentakun@gmail.com)                         #
-# Permission given to modify the code as long as you keep this        #
-# declaration at the top                                              #
-#######################################################################
-*/
-
-#include <vector>
-#include <random>
-#include <iostream>
-#include <functional>
-#include <unordered_map>
-using namespace std;
-
-const int BOARD_DIM = 3;
-const int BOARD_SIZE = BOARD_DIM * BOARD_DIM;
-const int BlankCell = 0;
-const int PlayerX = 1;
-const int PlayerO = -1;
-const int WinnerX = 1;
-const int WinnerO = -1;
-const int Tie = 0;
-
-static string initial_state_hash = "";
-default_random_engine global_generator;
-
-class State {
-private:
-	bool done_ = false;
-	int win_   = Tie;
-	string hash_;
-	vector<int> board_;
-public:
-	State() = default;
-	State(const vector<int>& board) { board_ = board; hash_ = hash(board_); }
-	State(const vector<int>&& board) { board_ = move(board); hash_ = hash(board_); }
-	State(const State&& t) { done_ = t.done_; win_ = t.win_; board_ = move(t.board_); hash_ = t.hash(); }
-	State& operator = (const State&& t) {
-		if (this != &t) { done_ = t.done_; win_ = t.win_; board_ = move(t.board_); hash_ = t.hash(); }
-		return *this;
-	}
-	static string hash(const vector<int>& vec) {
-		string seed;
-		int cnt = 0;
-		char c = 0;
-		for (auto &x : vec) {
-			c = (c<<2) + (char)(x+1);
-			cnt = (cnt+1)%4;
-			if (cnt==0)	{seed.push_back(c); c=0;}
-		}
-		if (cnt>0) seed.push_back(c);
-		return seed;
-	}
-	inline bool done() const { return done_; }
-	inline void done(bool d) { done_ = d; }
-	inline void win(int w) { win_ = w; }
-	inline int  win() const { return win_; }
-	inline string hash() const { return hash_; }
-	inline int value(int row, int col) const { return board_[rowcol2pos(row, col)]; }
-	inline int value(int pos) const { return board_[pos]; }
-	static inline int rowcol2pos(int row, int col) { return row * BOARD_DIM + col; }
-	static inline pair<int, int> pos2rowcol(int pos) { return make_pair(pos / BOARD_DIM, pos%BOARD_DIM); }
-	static State* create_next(const State& t, int row, int col, int player) {
-		auto new_board = t.board_;
-		new_board[rowcol2pos(row, col)] = player;
-		return new State(move(new_board));
-	}
-	static string next_state_hash(const State& t, int row, int col, int player) {
-		auto player_backup = t.value(row, col);
-		const_cast<State&>(t).board_[rowcol2pos(row, col)] = player;
-		auto hash_value = hash(t.board_);
-		const_cast<State&>(t).board_[rowcol2pos(row, col)] = player_backup;
-		return hash_value;
-	}
-	static pair<bool, int> check_done_win(const State& t) {
-		vector<int> scores;
-		//rows, cols
-		for (int r = 0; r<BOARD_DIM; r++) {
-			int rscore = 0, cscore = 0;
-			for (int c = 0; c<BOARD_DIM; c++) {
-				rscore += t.value(r, c);
-				cscore += t.value(c, r);
-			}
-			scores.push_back(rscore);
-			scores.push_back(cscore);
-		}
-		//diag
-		int dscore = 0, rdscore = 0;
-		for (int r = 0; r<BOARD_DIM; r++) {
-			dscore += t.value(r, r);
-			rdscore += t.value(r, BOARD_DIM - 1 - r);
-		}
-		scores.push_back(dscore);
-		scores.push_back(rdscore);
-		for (auto score : scores) {
-			if (score == BOARD_DIM) return make_pair(true, WinnerX);
-			if (score == -BOARD_DIM) return make_pair(true, WinnerO);
-		}
-		int tot = 0;
-		for (auto x : t.board_) {
-			tot += abs(x);
-		}
-		if (tot == BOARD_SIZE) return make_pair(true, Tie); //Tie
-		return make_pair(false, Tie); // gaming is not done.
-	}
-	static unordered_map<string, State*>* create_all_states() {
-		auto all_states = new unordered_map<string, State*>;
-		// lambda function
-		function<void(const State&, int)> create_from_current = [&](const State& current_state, int player) {
-			for (int r = 0; r<BOARD_DIM; r++) {
-				for (int c = 0; c<BOARD_DIM; c++) {
-					if (current_state.value(r, c) == BlankCell) {
-						auto next_hash_value = State::next_state_hash(current_state, r, c, player);
-						if (all_states->find(next_hash_value) != all_states->end()) continue;
-						if (all_states->size() % 100 == 0) cout << "# of States = " << all_states->size() << endl;
-						auto next_state = State::create_next(current_state, r, c, player);
-						auto done_win = State::check_done_win(*next_state);
-						next_state->done(done_win.first);
-						next_state->win(done_win.second);
-						(*all_states)[next_hash_value] = next_state;
-						if (!next_state->done()) create_from_current(*next_state, -player);
-					}
-				}
-			}
-		};
-		State* init_state = new State(vector<int>(BOARD_SIZE, BlankCell));
-		initial_state_hash = init_state->hash();
-		(*all_states)[initial_state_hash] = init_state;
-		create_from_current(*init_state, PlayerX);
-
-		cout << "==================================================================" << endl;
-		cout << "Total # of states =" << all_states->size() << endl;
-		return all_states;
-	}
-};
-ostream& operator << (ostream& out, const State& t)
-{
-	for (int r = 0; r<BOARD_DIM; r++) {
-		out << "-------------" << endl;
-		string line = "|";
-		for (int c = 0; c<BOARD_DIM; c++) {
-			switch (t.value(r, c)) {
-			case BlankCell: line += " "; break;
-			case PlayerX: line += "X"; break;
-			case PlayerO: line += "O"; break;
-			};
-			line += "|";
-		}
-		out << line.c_str() << endl;
-	}
-	out << "-------------" << endl;
-	return out;
-}
-
-// Player
-class Player {
-public:
-	virtual void reset() = 0;
-	virtual int  role() = 0;
-	virtual void role(int role) = 0;
-	virtual void state(const State* pstate) = 0;
-	virtual void reward(double r) = 0;
-	virtual vector<int> action() = 0;
-	virtual unordered_map<string, double> value_table() const = 0;
-	virtual void value_table(const unordered_map<string, double>& vtable) = 0;
-};
-
-class AIPlayer : public Player {
-private:
-	int role_; // X or O
-	unordered_map<string, State*>* all_states_ptr_;
-	unordered_map<string, double> value_table_; //[state hash, state value]
-	double step_size_;
-	double explore_rate_;
-	vector<const State*> state_ptrs_;
-	uniform_real_distribution<double> unif_real_;
-public:
-	AIPlayer(int arole, unordered_map<string, State*>* all_states, double step_size = 0.1, double explore_rate = 0.1)
-		:step_size_(step_size), explore_rate_(explore_rate), all_states_ptr_(all_states) {
-		role(arole);
-		unif_real_.param(uniform_real_distribution<double>::param_type(0.0, 1.0));
-	}
-	void reset() { state_ptrs_.clear(); }
-	int role() { return role_; }
-	void role(int role)
-	{
-		role_ = role;
-		// initialize value table
-		for (auto &kv : *all_states_ptr_) {
-			if (kv.second->done())
-				value_table_[kv.first] = kv.second->win() == role_ ? 1 : 0;
-			else
-				value_table_[kv.first] = 0.5;
-		}
-	}
-	void state(const State* pstate) { state_ptrs_.push_back(pstate); }
-	void reward(double r)
-	{
-		// update reward, learning
-		if (state_ptrs_.empty()) return;
-		double target = r;
-		for (auto rit = state_ptrs_.rbegin(); rit != state_ptrs_.rend(); ++rit) {
-			auto lastest_state = *rit;
-			value_table_[lastest_state->hash()] += step_size_ * (target - value_table_[lastest_state->hash()]);
-			target = value_table_[lastest_state->hash()];
-		}
-		state_ptrs_.clear();
-	}
-	vector<int> action()
-	{
-		auto latest_state = state_ptrs_.back();
-		vector<const State*> possible_state_ptrs;
-		vector<pair<int, int>> possible_positions;
-		for (int r = 0; r<BOARD_DIM; r++) {
-			for (int c = 0; c<BOARD_DIM; c++) {
-				if (latest_state->value(r, c) == BlankCell) {
-					auto hash_value = State::next_state_hash(*latest_state, r, c, role_);
-					possible_state_ptrs.push_back((*all_states_ptr_)[hash_value]);
-					possible_positions.push_back(make_pair(r, c));
-				}
-			}
-		}
-		// check random pick
-		if (unif_real_(global_generator)<explore_rate_) {
-			uniform_int_distribution<int> unif_int(0, possible_positions.size() - 1);
-			auto pos = unif_int(global_generator);
-			state_ptrs_.clear();
-			return vector<int>({ possible_positions[pos].first,possible_positions[pos].second,role_ });
-		}
-
-		// pick the largest value
-		int max_pos = -1;
-		double max_value = INT64_MIN;
-		for (unsigned int i = 0; i<possible_state_ptrs.size(); i++) {
-			auto ps = possible_state_ptrs[i];
-			double value = value_table_[ps->hash()];
-			if (max_value<value) {
-				max_value = value;
-				max_pos = i;
-			}
-		}
-		return vector<int>({ possible_positions[max_pos].first,possible_positions[max_pos].second,role_ });
-	}
-	unordered_map<string, double> value_table() const { return value_table_; }
-	void value_table(const unordered_map<string, double>& vtable) { value_table_ = vtable; }
-};
-
-class HumanPlayer : public Player {
-private:
-	int role_;
-	const State* current_state_;
-public:
-	HumanPlayer(int arole) :current_state_(NULL) { role(arole); }
-	void reset() { current_state_ = NULL; }
-	int  role() { return role_; }
-	void role(int role) { role_ = role; }
-	void state(const State* pstate) { current_state_ = pstate; }
-	void reward(double r) {}
-	vector<int> action()
-	{
-		int pos;
-		do {
-			// Ask human to input
-			cout << "Input your position:"; cin >> pos;
-		} while (current_state_->value(pos) != BlankCell);
-		auto rc = State::pos2rowcol(pos);
-		return vector<int>({ rc.first,rc.second,role_ });
-	}
-	unordered_map<string, double> value_table() const { return unordered_map<string, double>(); }
-	void value_table(const unordered_map<string, double>& vtable) { }
-};
-
-// Judge
-class Judge {
-private:
-	Player * player1_;
-	Player* player2_;
-	Player* current_player_;
-	bool feedback_;
-	const State* current_state_;
-	unordered_map<string, State*>* all_states_ptr_;
-public:
-	Judge(unordered_map<string, State*>* all_states, Player* player1, Player* player2, bool feedback = true)
-		:all_states_ptr_(all_states), player1_(player1), player2_(player2), feedback_(feedback), current_player_(nullptr)
-	{
-		current_state_ = (*all_states_ptr_)[initial_state_hash];
-	}
-	void reward()
-	{
-		if (current_state_->win() == player1_->role()) {
-			player1_->reward(1);
-			player2_->reward(0);
-		}
-		else if (current_state_->win() == player2_->role()) {
-			player1_->reward(0);
-			player2_->reward(1);
-		}
-		else {
-			player1_->reward(0.1);
-			player2_->reward(0.5);
-		}
-	}
-	void feed_current_state()
-	{
-		player1_->state(current_state_);
-		player2_->state(current_state_);
-	}
-	void reset()
-	{
-		player1_->reset();
-		player2_->reset();
-		current_player_ = nullptr;
-		current_state_ = (*all_states_ptr_)[initial_state_hash];
-	}
-	int play(bool show = false)
-	{
-		reset();
-		feed_current_state();
-		while (true) {
-			current_player_ = current_player_ == player1_ ? player2_ : player1_;
-			if (show) cout << *current_state_;
-			auto action = current_player_->action();
-			auto next_hash = State::next_state_hash(*current_state_, action[0], action[1], action[2]);
-			current_state_ = (*all_states_ptr_)[next_hash];
-			feed_current_state();
-			if (current_state_->done()) {
-				if (feedback_) reward();
-				return current_state_->win();
-			}
-		}
-	}
-};
-
-class TicTacToe
-{
-private:
-	unordered_map<string, State*>* all_states_=NULL;
-	unordered_map<int, unordered_map<string, double> > value_tables; //[player role, [state hash, estimated value]]
-public:
-	TicTacToe() { all_states_ = State::create_all_states(); }
-	~TicTacToe() {
-		if (all_states_ != NULL) {
-			for (auto kv : *all_states_) if (kv.second != NULL) delete kv.second;
-			delete all_states_;
-		}
-	}
-	void train(int epochs = 20000)
-	{
-		AIPlayer player1(PlayerX, all_states_), player2(PlayerO, all_states_);
-		Judge judge(all_states_, &player1, &player2);
-		double player1_win = 0, player2_win = 0;
-		for (int i = 0; i<epochs; i++) {
-			if (i % 100 == 0) cout << "Epoch " << i << ": " << endl;
-			int winner = judge.play();
-			if (winner == player1.role()) player1_win += 1;
-			if (winner == player2.role()) player2_win += 1;
-			judge.reset();
-		}
-		cout << "Player 1 Win : " << player1_win / epochs << endl;
-		cout << "Player 2 Win : " << player2_win / epochs << endl;
-		value_tables[player1.role()] = player1.value_table();
-		value_tables[player2.role()] = player2.value_table();
-	}
-	void compete(int turns = 500)
-	{
-		AIPlayer player1(PlayerX, all_states_, 0.1, 0), player2(PlayerO, all_states_, 0.1, 0);
-		Judge judge(all_states_, &player1, &player2, false);
-		player1.value_table(value_tables[player1.role()]);
-		player2.value_table(value_tables[player2.role()]);
-		double player1_win = 0, player2_win = 0;
-		for (int i = 0; i<turns; i++) {
-			if (i % 100 == 0) cout << "Epoch " << i << ": " << endl;
-			int winner = judge.play();
-			if (winner == player1.role()) player1_win += 1;
-			if (winner == player2.role()) player2_win += 1;
-			judge.reset();
-		}
-		cout << "Player 1 Win : " << player1_win / turns << endl;
-		cout << "Player 2 Win : " << player2_win / turns << endl;
-	}
-	void play()
-	{
-		while (true) {
-			AIPlayer ai_player(PlayerX, all_states_, 0.1, 0);
-			HumanPlayer man_player(PlayerO);
-			Judge judge(all_states_, &ai_player, &man_player, false);
-			ai_player.value_table(value_tables[ai_player.role()]);
-			int winner = judge.play(true);
-			if (winner == ai_player.role()) cout << " Lose !" << endl;
-			else if (winner == man_player.role()) cout << " Win !" << endl;
-			else cout << " Tie !" << endl;
-		}
-	}
-};
-
-int main()
-{
-	TicTacToe tic;
-	tic.train(100000);
-	tic.compete(1000);
-	tic.play();
-	return 0;
-}
\ No newline at end of file
+/*
+#######################################################################
+# Copyright (C)                                                       #
+# 2018 Donghai He(gsutilml@gmail.com)                                 #
+# 2018 Yuanyao Liu                                                    #
+# Permission given to modify the code as long as you keep this        #
+# declaration at the top                                              #
+#######################################################################
+
+#######################################################################
+# Copyright (C)                                                       #
+# 2016 - 2018 Shangtong Zhang(zhangshangtong.cpp@gmail.com)           #
+# 2016 Jan Hakenberg(jan.hakenberg@gmail.com)                         #
+# 2016 Tian Jun(tianjun.cpp@gmail.com)                                #
+# 2016 Kenta Shimada(hyperkentakun@gmail.com)                         #
+# Permission given to modify the code as long as you keep this        #
+# declaration at the top                                              #
+#######################################################################
+*/
+
+#include <array>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <bitset>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <fstream>
+#include <unordered_map>
+#include <atomic>
+#include <sstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+using namespace std;
+
+const int BlankCell = 0;
+const int PlayerX = 1;
+const int PlayerO = -1;
+const int WinnerX = 1;
+const int WinnerO = -1;
+const int Tie = 0;
+
+default_random_engine global_generator;
+
+// Split [0, n) into contiguous chunks and run fn(begin, end, worker) for each chunk on its own thread
+template<class Fn>
+void parallel_for(int n, int num_workers, Fn fn)
+{
+	num_workers = max(1, min(num_workers, n));
+	int chunk = (n + num_workers - 1) / max(1, num_workers);
+	vector<thread> workers;
+	for (int w = 1; w<num_workers; w++)
+		workers.push_back(thread(fn, min(n, w * chunk), min(n, (w + 1) * chunk), w));
+	fn(0, min(n, chunk), 0);
+	for (auto &t : workers) t.join();
+}
+
+// Packed board: bit pos is set in the low 32 bits for an X at pos and in the high 32 bits for an O at pos
+typedef uint64_t StateKey;
+const int PlayerOShift = 32;
+const int NumSymmetries = 8; // dihedral group of the square
+
+// One player's half of a StateKey, bit pos is set if the player has a piece at pos
+typedef uint32_t BitBoard;
+
+// Winning lines as bit masks, generated at compile time for each board dimension: rows, then columns, then both diagonals
+template<int DIM>
+struct Lines {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+	static const int NumLines = 2 * BOARD_DIM + 2;
+	static const BitBoard FullBoard = BOARD_SIZE == 32 ? ~BitBoard(0) : (BitBoard(1) << BOARD_SIZE) - 1;
+	static constexpr BitBoard bit(int row, int col) { return BitBoard(1) << (row * BOARD_DIM + col); }
+	static constexpr BitBoard row(int r, int c = 0) { return c == BOARD_DIM ? 0 : bit(r, c) | row(r, c + 1); }
+	static constexpr BitBoard col(int c, int r = 0) { return r == BOARD_DIM ? 0 : bit(r, c) | col(c, r + 1); }
+	static constexpr BitBoard diag(int r = 0) { return r == BOARD_DIM ? 0 : bit(r, r) | diag(r + 1); }
+	static constexpr BitBoard anti_diag(int r = 0) { return r == BOARD_DIM ? 0 : bit(r, BOARD_DIM - 1 - r) | anti_diag(r + 1); }
+	static constexpr BitBoard mask(int i) {
+		return i < BOARD_DIM ? row(i) : i < 2 * BOARD_DIM ? col(i - BOARD_DIM) : i == 2 * BOARD_DIM ? diag() : anti_diag();
+	}
+	static constexpr bool full(BitBoard b, BitBoard m) { return (b & m) == m; }
+	static inline bool any_line(BitBoard b) {
+		for (int i = 0; i<NumLines; i++)
+			if (full(b, mask(i))) return true;
+		return false;
+	}
+	// only the row, the column and the diagonals that contain pos
+	static inline bool line_through(BitBoard b, int pos) {
+		int r = pos / BOARD_DIM, c = pos % BOARD_DIM;
+		return full(b, row(r)) || full(b, col(c)) ||
+			(r == c && full(b, diag())) || (r + c == BOARD_DIM - 1 && full(b, anti_diag()));
+	}
+};
+
+template<int DIM>
+class State {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+	static_assert(BOARD_SIZE <= PlayerOShift, "board does not fit in a packed StateKey");
+private:
+	// fixed 16-byte POD layout: states live in one contiguous array and are written to snapshots as is
+	StateKey key_ = 0;
+	int32_t id_   = -1;
+	int8_t win_   = Tie;
+	bool done_    = false;
+public:
+	State() = default;
+	explicit State(StateKey key) : key_(key) {}
+	static inline StateKey cell_bit(int pos, int player) { return StateKey(1) << (player == PlayerO ? pos + PlayerOShift : pos); }
+	inline bool done() const { return done_; }
+	inline void done(bool d) { done_ = d; }
+	inline void win(int w) { win_ = (int8_t)w; }
+	inline int  win() const { return win_; }
+	inline int  id() const { return id_; }
+	inline void id(int i) { id_ = i; }
+	inline StateKey key() const { return key_; }
+	inline int value(int row, int col) const { return value(rowcol2pos(row, col)); }
+	inline int value(int pos) const {
+		if (key_ & cell_bit(pos, PlayerX)) return PlayerX;
+		if (key_ & cell_bit(pos, PlayerO)) return PlayerO;
+		return BlankCell;
+	}
+	static inline int rowcol2pos(int row, int col) { return row * BOARD_DIM + col; }
+	static inline pair<int, int> pos2rowcol(int pos) { return make_pair(pos / BOARD_DIM, pos%BOARD_DIM); }
+	// symmetry sym in [0, NumSymmetries): rotate the board (sym & 3) quarter turns, then mirror it if (sym & 4)
+	static int symmetric_pos(int pos, int sym) {
+		int r = pos / BOARD_DIM, c = pos % BOARD_DIM;
+		for (int i = 0; i < (sym & 3); i++) {
+			int t = r; r = c; c = BOARD_DIM - 1 - t;
+		}
+		if (sym & 4) c = BOARD_DIM - 1 - c;
+		return rowcol2pos(r, c);
+	}
+	static StateKey transform(StateKey key, int sym) {
+		static const array<array<int, BOARD_SIZE>, NumSymmetries> perms = []() {
+			array<array<int, BOARD_SIZE>, NumSymmetries> p;
+			for (int s = 0; s<NumSymmetries; s++)
+				for (int pos = 0; pos<BOARD_SIZE; pos++) p[s][pos] = symmetric_pos(pos, s);
+			return p;
+		}();
+		auto &perm = perms[sym];
+		StateKey res = 0;
+		for (int pos = 0; pos<BOARD_SIZE; pos++) {
+			if (key & cell_bit(pos, PlayerX)) res |= cell_bit(perm[pos], PlayerX);
+			else if (key & cell_bit(pos, PlayerO)) res |= cell_bit(perm[pos], PlayerO);
+		}
+		return res;
+	}
+	// representative of the board's equivalence class under the symmetries of the square
+	static StateKey canonical_key(StateKey key) {
+		StateKey res = key;
+		for (int sym = 1; sym<NumSymmetries; sym++) res = min(res, transform(key, sym));
+		return res;
+	}
+	inline BitBoard bits(int player) const { return BitBoard(player == PlayerO ? key_ >> PlayerOShift : key_); }
+	static pair<bool, int> check_done_win(const State& t) {
+		auto x = t.bits(PlayerX), o = t.bits(PlayerO);
+		if (Lines<DIM>::any_line(x)) return make_pair(true, WinnerX);
+		if (Lines<DIM>::any_line(o)) return make_pair(true, WinnerO);
+		if ((x | o) == Lines<DIM>::FullBoard) return make_pair(true, Tie); //Tie
+		return make_pair(false, Tie); // gaming is not done.
+	}
+	// same as check_done_win for a board that was not done before player put a piece at pos,
+	// only the lines through pos have to be looked at
+	static pair<bool, int> check_done_win(const State& t, int pos, int player) {
+		if (Lines<DIM>::line_through(t.bits(player), pos)) return make_pair(true, player == PlayerX ? WinnerX : WinnerO);
+		if ((t.bits(PlayerX) | t.bits(PlayerO)) == Lines<DIM>::FullBoard) return make_pair(true, Tie); //Tie
+		return make_pair(false, Tie);
+	}
+};
+
+static_assert(sizeof(State<3>) == 16 && sizeof(State<4>) == 16, "State is expected to pack into 16 bytes");
+
+// Contiguous array that either owns its elements or views memory kept alive by someone else,
+// e.g. a section of a mapped snapshot file
+template<class T>
+class Storage {
+private:
+	vector<T> own_;
+	T* data_ = nullptr;
+	size_t size_ = 0;
+public:
+	void resize(size_t n, const T& v = T()) { own_.resize(n, v); data_ = own_.data(); size_ = n; }
+	void view(T* data, size_t n) { vector<T>().swap(own_); data_ = data; size_ = n; }
+	void shrink_to_fit() { own_.shrink_to_fit(); if (!own_.empty()) data_ = own_.data(); }
+	inline size_t bytes() const { return size_ * sizeof(T); }
+	inline size_t size() const { return size_; }
+	inline T* data() { return data_; }
+	inline const T* data() const { return data_; }
+	inline T& operator[](size_t i) { return data_[i]; }
+	inline const T& operator[](size_t i) const { return data_[i]; }
+};
+
+// A file mapped copy-on-write into memory: pages are shared between processes until written to,
+// and writes never reach the file. Without mmap the file is read into memory instead.
+class MappedFile {
+private:
+	char* data_ = nullptr;
+	size_t size_ = 0;
+#ifdef _WIN32
+	vector<char> buffer_;
+#endif
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+public:
+	~MappedFile() {
+#ifndef _WIN32
+		if (data_ != nullptr) munmap(data_, size_);
+#endif
+	}
+	inline char* data() const { return data_; }
+	inline size_t size() const { return size_; }
+	// nullptr if the file cannot be read
+	static shared_ptr<MappedFile> open(const string& path) {
+		shared_ptr<MappedFile> file(new MappedFile);
+#ifdef _WIN32
+		ifstream in(path, ios::binary);
+		if (!in) return nullptr;
+		file->buffer_.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+		file->data_ = file->buffer_.data();
+		file->size_ = file->buffer_.size();
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return nullptr;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				file->data_ = (char*)p;
+				file->size_ = st.st_size;
+			}
+		}
+		close(fd);
+#endif
+		return file->data_ == nullptr ? nullptr : file;
+	}
+};
+
+// All reachable states stored contiguously and indexed by a dense state id, the initial state has id 0.
+// Ids are ordered by ply, then by shard of the key, then by key, so a state is found by a binary search
+// in its (ply, shard) range of ids and the table needs no hash index, also when it is mapped from a snapshot.
+// A symmetric table keeps one canonical state per equivalence class, and find() canonicalizes its key,
+// so players see canonical boards and share one value per class; Judge keeps the board as played.
+// A lazy table instead creates states when play first reaches them, in a fixed number of slots that
+// serve as ids, and evicts states between games once the slots run out; see create_lazy_states().
+template<int DIM>
+class StateTable {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+public:
+	enum { NumShards = 64, NumRanges = (BOARD_SIZE + 1) * NumShards + 1 };
+	// slots one game may need in a lazy table: every move of every state of the game gets expanded
+	enum { GameSlots = BOARD_SIZE * BOARD_SIZE };
+private:
+	enum { Unknown = -2 }; // successor of a lazy table not created yet
+	bool symmetric_;
+	// lazy table: the cache changes as play reaches new states, the game it represents does not,
+	// so the states, the successors and the members below are updated by const lookups
+	mutable Storage<State<DIM>> states_;
+	mutable Storage<int> next_;   //[state id * BOARD_SIZE + pos, successor state id or -1]
+	Storage<int> ranges_;         //[ply * NumShards + shard, first state id of the shard in the ply]
+	shared_ptr<MappedFile> file_;
+	bool lazy_ = false;
+	mutable unordered_map<StateKey, int> index_; //[key, slot]
+	mutable vector<int> free_slots_;
+	mutable vector<uint32_t> generations_;       //[slot, times a state was created in it]
+	mutable long long num_created_ = 0, num_evicted_ = 0;
+	// lazy table: creates the successor of state id by a move at pos unless it is cached, and links it
+	int expand(int id, int pos) const {
+		const State<DIM>& t = states_[id];
+		int next_id = -1;
+		if (!t.done() && t.value(pos) == BlankCell) {
+			int player = ply(t.key()) % 2 == 0 ? PlayerX : PlayerO;
+			State<DIM> next_state(t.key() | State<DIM>::cell_bit(pos, player));
+			auto done_win = State<DIM>::check_done_win(next_state, pos, player);
+			StateKey key = canonical(next_state.key());
+			auto it = index_.find(key);
+			if (it != index_.end()) {
+				next_id = it->second;
+			}
+			else {
+				if (free_slots_.empty()) {
+					cout << "State cache is full, collect() has to run between games" << endl;
+					exit(1);
+				}
+				next_id = free_slots_.back();
+				free_slots_.pop_back();
+				State<DIM> created(key);
+				created.done(done_win.first);
+				created.win(done_win.second);
+				created.id(next_id);
+				states_[next_id] = created;
+				generations_[next_id]++;
+				index_[key] = next_id;
+				num_created_++;
+			}
+		}
+		next_[size_t(id) * BOARD_SIZE + pos] = next_id;
+		return next_id;
+	}
+	// lazy table: frees a slot, links to it are reset by the caller
+	void evict(int id) {
+		index_.erase(states_[id].key());
+		states_[id].id(-1);
+		fill(&next_[size_t(id) * BOARD_SIZE], &next_[size_t(id + 1) * BOARD_SIZE], (int)Unknown);
+		free_slots_.push_back(id);
+		num_evicted_++;
+	}
+public:
+	StateTable(bool symmetric = false) : symmetric_(symmetric) {}
+	// a table over the states, successors and ranges sections of a mapped snapshot
+	StateTable(bool symmetric, shared_ptr<MappedFile> file, State<DIM>* states, int size, int* next, int* ranges)
+		: symmetric_(symmetric), file_(file) {
+		states_.view(states, size);
+		next_.view(next, size_t(size) * BOARD_SIZE);
+		ranges_.view(ranges, NumRanges);
+	}
+	// whether every state sits at its id, every successor is -1 or a state of the table and the ranges
+	// partition the ids in order, so that nothing read from a mapped snapshot indexes outside of it
+	bool consistent() const {
+		int n = size();
+		for (int id = 0; id<n; id++)
+			if (states_[id].id() != id) return false;
+		for (size_t i = 0; i<next_.size(); i++)
+			if (next_[i] < -1 || next_[i] >= n) return false;
+		if (ranges_[0] != 0 || ranges_[NumRanges - 1] != n) return false;
+		for (int r = 1; r<NumRanges; r++)
+			if (ranges_[r] < ranges_[r - 1]) return false;
+		return true;
+	}
+	static inline int shard(StateKey key) { return int((key * 0x9E3779B97F4A7C15ull) >> 58); }
+	static inline int ply(StateKey key) { return (int)bitset<64>(key).count(); }
+	inline bool symmetric() const { return symmetric_; }
+	inline StateKey canonical(StateKey key) const { return symmetric_ ? State<DIM>::canonical_key(key) : key; }
+	inline int size() const { return (int)states_.size(); }
+	inline const State<DIM>& operator[](int id) const { return states_[id]; }
+	inline const State<DIM>* initial() const { return &states_[0]; }
+	inline const State<DIM>* states() const { return states_.data(); }
+	inline const int* ranges() const { return ranges_.data(); }
+	inline size_t bytes() const { return states_.bytes() + next_.bytes() + ranges_.bytes(); }
+	inline bool lazy() const { return lazy_; }
+	// lazy table: a value stored for slot id belongs to the current state only if stored in this generation
+	inline uint32_t generation(int id) const { return generations_[id]; }
+	// bytes per slot of a lazy table: state, successors, generation, index entry, and value and generation
+	// in the two value tables
+	static size_t lazy_bytes_per_state() {
+		return sizeof(State<DIM>) + BOARD_SIZE * sizeof(int) + sizeof(uint32_t) + 48 + 2 * (sizeof(double) + sizeof(uint32_t));
+	}
+	// Lazy table of as many slots as fit in max_bytes. Only the initial state exists at first, the others
+	// are created by next() when a player looks at them, and collect() makes room between games. Value
+	// tables learn per slot, the value of an evicted state is forgotten. Not for parallel training.
+	static StateTable* create_lazy_states(bool symmetric, size_t max_bytes) {
+		auto all_states = new StateTable(symmetric);
+		int capacity = (int)min(max_bytes / lazy_bytes_per_state(), size_t(numeric_limits<int>::max() / BOARD_SIZE));
+		capacity = max(capacity, 4 * (int)GameSlots);
+		all_states->lazy_ = true;
+		all_states->states_.resize(capacity);
+		all_states->next_.resize(size_t(capacity) * BOARD_SIZE, Unknown);
+		all_states->generations_.assign(capacity, 0);
+		all_states->index_.reserve(capacity);
+		for (int id = capacity - 1; id > 0; id--) all_states->free_slots_.push_back(id);
+		all_states->states_[0] = State<DIM>(0);
+		all_states->states_[0].id(0);
+		all_states->generations_[0] = 1;
+		all_states->index_[0] = 0;
+		cout << "==================================================================" << endl;
+		cout << "Lazy states : " << capacity << " slots of " << lazy_bytes_per_state() << " bytes" << endl;
+		return all_states;
+	}
+	// Lazy table, between games only, when no game holds an id: once less than a game's worth of slots is
+	// free, evicts states until a tenth of the slots is. Finished states go first, their values are fixed
+	// anyway, then the deepest plies, so the states near the opening that most games pass stay cached.
+	void collect() {
+		if (!lazy_ || free_slots_.size() >= GameSlots) return;
+		int capacity = size();
+		int needed = max(capacity / 10, 2 * (int)GameSlots) - (int)free_slots_.size();
+		// eviction order: finished states, then ply BOARD_SIZE down to 1, the initial state is kept
+		auto rank = [&](const State<DIM>& t) { return t.done() ? BOARD_SIZE + 1 : ply(t.key()); };
+		vector<int> count(BOARD_SIZE + 2, 0);
+		for (int id = 1; id<capacity; id++)
+			if (states_[id].id() == id) count[rank(states_[id])]++;
+		int last_rank = BOARD_SIZE + 1;
+		while (last_rank > 1 && count[last_rank] < needed) needed -= count[last_rank--];
+		for (int id = 1; id<capacity; id++) {
+			if (states_[id].id() != id) continue;
+			int r = rank(states_[id]);
+			if (r > last_rank || (r == last_rank && needed-- > 0)) evict(id);
+		}
+		// reset the links to evicted states
+		for (int id = 0; id<capacity; id++) {
+			if (states_[id].id() != id) continue;
+			for (int pos = 0; pos<BOARD_SIZE; pos++) {
+				int& next_id = next_[size_t(id) * BOARD_SIZE + pos];
+				if (next_id >= 0 && states_[next_id].id() != next_id) next_id = Unknown;
+			}
+		}
+	}
+	// lazy table: slots in use, states created and evicted so far
+	void print_cache() const {
+		cout << "Cached states : " << size() - (int)free_slots_.size() << " of " << size()
+			<< ", created " << num_created_ << ", evicted " << num_evicted_ << endl;
+	}
+	// id of the state reached by a move at pos, -1 if pos is taken or the game is over
+	inline int next(int id, int pos) const {
+		int next_id = next_[size_t(id) * BOARD_SIZE + pos];
+		return next_id != Unknown ? next_id : expand(id, pos);
+	}
+	inline const int* successors(int id) const { return &next_[size_t(id) * BOARD_SIZE]; }
+	inline const State<DIM>* next_state(const State<DIM>& t, int pos) const { return &states_[next(t.id(), pos)]; }
+	inline const State<DIM>* find(StateKey key) const {
+		key = canonical(key);
+		if (lazy_) {
+			auto it = index_.find(key);
+			return it != index_.end() ? &states_[it->second] : nullptr;
+		}
+		int r = ply(key) * NumShards + shard(key);
+		auto first = states_.data() + ranges_[r], last = states_.data() + ranges_[r + 1];
+		auto it = lower_bound(first, last, key, [](const State<DIM>& t, StateKey k) { return t.key() < k; });
+		return it != last && it->key() == key ? it : nullptr;
+	}
+	// Level-synchronous enumeration: every state of ply k holds k pieces, so the states of ply k+1 are
+	// exactly the successors of the unfinished states of ply k. Each ply's frontier is expanded by all
+	// workers into per-worker buckets of the shards, then every shard is sorted and deduplicated
+	// independently. Ids only depend on the shard layout, so the table is the same for any worker count.
+	// Once a ply has its ids, the successor ids of the ply before are filled in.
+	static StateTable* create_all_states(bool symmetric = false, int num_workers = 0) {
+		if (num_workers <= 0) num_workers = max(1u, thread::hardware_concurrency());
+		auto all_states = new StateTable(symmetric);
+		all_states->states_.resize(1, State<DIM>(0));
+		all_states->states_[0].id(0);
+		all_states->next_.resize(BOARD_SIZE, -1);
+		all_states->ranges_.resize(NumRanges, -1);
+		all_states->ranges_[0] = 0;
+		vector<int> frontier(1, 0); // unfinished states of the current ply
+		int player = PlayerX;
+		for (int ply = 1; !frontier.empty(); ply++, player = -player) {
+			vector<vector<vector<StateKey>>> buckets(num_workers, vector<vector<StateKey>>(NumShards));
+			parallel_for((int)frontier.size(), num_workers, [&](int begin, int end, int worker) {
+				auto &bucket = buckets[worker];
+				for (int i = begin; i<end; i++) {
+					const State<DIM>& current_state = (*all_states)[frontier[i]];
+					for (int pos = 0; pos<BOARD_SIZE; pos++) {
+						if (current_state.value(pos) != BlankCell) continue;
+						auto next_key = all_states->canonical(current_state.key() | State<DIM>::cell_bit(pos, player));
+						bucket[shard(next_key)].push_back(next_key);
+					}
+				}
+			});
+			vector<vector<StateKey>> shards(NumShards);
+			parallel_for(NumShards, num_workers, [&](int begin, int end, int) {
+				for (int sh = begin; sh<end; sh++) {
+					auto &keys = shards[sh];
+					for (auto &bucket : buckets) keys.insert(keys.end(), bucket[sh].begin(), bucket[sh].end());
+					sort(keys.begin(), keys.end());
+					keys.erase(unique(keys.begin(), keys.end()), keys.end());
+				}
+			});
+			buckets.clear();
+			auto offsets = &all_states->ranges_[ply * NumShards];
+			offsets[0] = all_states->size();
+			for (int sh = 0; sh<NumShards; sh++) offsets[sh + 1] = offsets[sh] + (int)shards[sh].size();
+			all_states->states_.resize(offsets[NumShards]);
+			parallel_for(NumShards, num_workers, [&](int begin, int end, int) {
+				for (int sh = begin; sh<end; sh++) {
+					for (size_t i = 0; i<shards[sh].size(); i++) {
+						State<DIM> next_state(shards[sh][i]);
+						auto done_win = State<DIM>::check_done_win(next_state);
+						next_state.done(done_win.first);
+						next_state.win(done_win.second);
+						next_state.id(offsets[sh] + (int)i);
+						all_states->states_[next_state.id()] = next_state;
+					}
+				}
+			});
+			vector<int> next_frontier;
+			for (int id = offsets[0]; id<all_states->size(); id++) {
+				if (!(*all_states)[id].done()) next_frontier.push_back(id);
+			}
+			all_states->next_.resize(size_t(all_states->size()) * BOARD_SIZE, -1);
+			parallel_for((int)frontier.size(), num_workers, [&](int begin, int end, int) {
+				for (int i = begin; i<end; i++) {
+					const State<DIM>& current_state = (*all_states)[frontier[i]];
+					for (int pos = 0; pos<BOARD_SIZE; pos++) {
+						if (current_state.value(pos) != BlankCell) continue;
+						auto next_state = all_states->find(current_state.key() | State<DIM>::cell_bit(pos, player));
+						all_states->next_[size_t(frontier[i]) * BOARD_SIZE + pos] = next_state->id();
+					}
+				}
+			});
+			frontier = move(next_frontier);
+			cout << "Ply " << ply << ": # of States = " << all_states->size() << endl;
+		}
+		// plies that were never reached are empty
+		for (int r = NumRanges - 1; r >= 0; r--)
+			if (all_states->ranges_[r] < 0) all_states->ranges_[r] = r + 1 < NumRanges ? all_states->ranges_[r + 1] : all_states->size();
+
+		all_states->states_.shrink_to_fit();
+		all_states->next_.shrink_to_fit();
+
+		cout << "==================================================================" << endl;
+		cout << "Total # of states =" << all_states->size() << endl;
+		cout << "Bytes per state =" << double(all_states->bytes()) / all_states->size() << " (state " << sizeof(State<DIM>)
+			<< ", successors " << BOARD_SIZE * sizeof(int) << ", " << all_states->bytes() / (1 << 20) << " MB in total)" << endl;
+		return all_states;
+	}
+};
+template<int DIM>
+ostream& operator << (ostream& out, const State<DIM>& t)
+{
+	for (int r = 0; r<DIM; r++) {
+		out << "-------------" << endl;
+		string line = "|";
+		for (int c = 0; c<DIM; c++) {
+			switch (t.value(r, c)) {
+			case BlankCell: line += " "; break;
+			case PlayerX: line += "X"; break;
+			case PlayerO: line += "O"; break;
+			};
+			line += "|";
+		}
+		out << line.c_str() << endl;
+	}
+	out << "-------------" << endl;
+	return out;
+}
+
+// A learned value that threads read and update without locks. Relaxed atomic loads and stores are
+// plain moves on common hardware, so a racing update may still be lost, but it is not a data race.
+// Laid out like a double, so the values section of a mapped snapshot is viewed in place.
+struct SharedValue {
+	atomic<double> v;
+	SharedValue(double x = 0) : v(x) {}
+	SharedValue(const SharedValue& other) : v(other.load()) {}
+	SharedValue& operator=(const SharedValue& other) { store(other.load()); return *this; }
+	inline double load() const { return v.load(memory_order_relaxed); }
+	inline void store(double x) { v.store(x, memory_order_relaxed); }
+};
+
+static_assert(sizeof(SharedValue) == sizeof(double), "snapshot values are mapped as SharedValues");
+
+// Estimated values of one role, stored contiguously and indexed by dense state id
+template<int DIM>
+class ValueTable {
+private:
+	int role_;
+	Storage<SharedValue> values_;
+	shared_ptr<MappedFile> file_;
+	// lazy state table: a value is only valid for the state created in its slot in the same generation
+	const StateTable<DIM>* lazy_states_ = nullptr;
+	vector<uint32_t> generations_;
+	inline double initial_value(const State<DIM>& t) const {
+		if (t.done())
+			return t.win() == role_ ? 1 : 0;
+		return 0.5;
+	}
+public:
+	ValueTable(const StateTable<DIM>& all_states, int role) : role_(role) {
+		values_.resize(all_states.size());
+		if (all_states.lazy()) {
+			lazy_states_ = &all_states;
+			generations_.assign(all_states.size(), 0);
+			return;
+		}
+		for (int id = 0; id<all_states.size(); id++) values_[id].store(initial_value(all_states[id]));
+	}
+	// a table over the values section of a mapped snapshot, training on it only changes private pages
+	ValueTable(int role, shared_ptr<MappedFile> file, double* values, int size) : role_(role), file_(file) {
+		values_.view((SharedValue*)values, size);
+	}
+	inline int role() const { return role_; }
+	inline int size() const { return (int)values_.size(); }
+	// the stored values into out[0, size())
+	void copy_values(double* out) const {
+		for (int id = 0; id<size(); id++) out[id] = values_[id].load();
+	}
+	inline double value(int id) const {
+		if (lazy_states_ != nullptr && generations_[id] != lazy_states_->generation(id)) return initial_value((*lazy_states_)[id]);
+		return values_[id].load();
+	}
+	inline void value(int id, double v) {
+		if (lazy_states_ != nullptr) generations_[id] = lazy_states_->generation(id);
+		values_[id].store(v);
+	}
+	// move the value of state id a step towards target and return the new value. Parallel training
+	// runs this from many threads without locking (Hogwild): the value is a SharedValue, so a backup
+	// that races with another may overwrite it, which is accepted, but there is no undefined behaviour.
+	inline double backup(int id, double target, double step_size) {
+		double v = value(id);
+		v += step_size * (target - v);
+		value(id, v);
+		return v;
+	}
+};
+
+// TD backups recorded instead of applied, so that games can be played against frozen value tables
+// and their updates applied later in a fixed order
+template<int DIM>
+class BackupLog {
+private:
+	struct Backup { ValueTable<DIM>* table; double reward; double step_size; size_t end; };
+	vector<int> ids_; // state ids of all recorded games, back to back
+	vector<Backup> backups_;
+public:
+	void record(ValueTable<DIM>* table, double reward, double step_size, const vector<const State<DIM>*>& states) {
+		for (auto pstate : states) ids_.push_back(pstate->id());
+		backups_.push_back({ table, reward, step_size, ids_.size() });
+	}
+	void apply() {
+		size_t begin = 0;
+		for (auto &b : backups_) {
+			double target = b.reward;
+			for (size_t i = b.end; i-- > begin;) target = b.table->backup(ids_[i], target, b.step_size);
+			begin = b.end;
+		}
+		ids_.clear();
+		backups_.clear();
+	}
+};
+
+// Game-theoretic outcome of every state under perfect play of both sides: WinnerX, WinnerO or Tie.
+// The successors of a ply-k state all lie in ply k+1, so the table is solved backwards from the last ply,
+// the states of one ply in parallel once the ply after it is labelled.
+template<int DIM>
+class Solver {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+private:
+	const StateTable<DIM>* all_states_ptr_;
+	vector<int8_t> outcomes_;
+public:
+	Solver(const StateTable<DIM>* all_states, int num_workers = 0) : all_states_ptr_(all_states) {
+		if (num_workers <= 0) num_workers = max(1u, thread::hardware_concurrency());
+		outcomes_.resize(all_states->size());
+		const int* ranges = all_states->ranges();
+		for (int ply = BOARD_SIZE; ply >= 0; ply--) {
+			int first = ranges[ply * StateTable<DIM>::NumShards], last = ranges[(ply + 1) * StateTable<DIM>::NumShards];
+			parallel_for(last - first, num_workers, [&](int begin, int end, int) {
+				for (int id = first + begin; id<first + end; id++) {
+					const State<DIM>& t = (*all_states_ptr_)[id];
+					if (t.done()) {
+						outcomes_[id] = (int8_t)t.win();
+						continue;
+					}
+					// the player to move takes the outcome best for itself, X maximizes and O minimizes
+					int role = to_move(t), best = -role;
+					for (int pos = 0; pos<BOARD_SIZE; pos++) {
+						int next_id = all_states_ptr_->next(id, pos);
+						if (next_id >= 0 && outcomes_[next_id] * role > best * role) best = outcomes_[next_id];
+					}
+					outcomes_[id] = (int8_t)best;
+				}
+			});
+		}
+	}
+	// X moves on even plies, O on odd ones
+	static inline int to_move(const State<DIM>& t) { return StateTable<DIM>::ply(t.key()) % 2 == 0 ? PlayerX : PlayerO; }
+	inline int outcome(int id) const { return outcomes_[id]; }
+	// whether the move at pos keeps the best outcome reachable for the player to move
+	inline bool optimal(int id, int pos) const {
+		int next_id = all_states_ptr_->next(id, pos);
+		return next_id >= 0 && outcomes_[next_id] == outcomes_[id];
+	}
+	// Fraction of the unfinished states with vtable's role to move where the greedy policy on vtable,
+	// ties broken towards the lowest position as AIPlayer does, picks an optimal move
+	double policy_optimality(const ValueTable<DIM>& vtable, int num_workers = 0) const {
+		if (num_workers <= 0) num_workers = max(1u, thread::hardware_concurrency());
+		vector<pair<long long, long long>> counts(num_workers, make_pair(0LL, 0LL));
+		parallel_for(all_states_ptr_->size(), num_workers, [&](int begin, int end, int worker) {
+			for (int id = begin; id<end; id++) {
+				const State<DIM>& t = (*all_states_ptr_)[id];
+				if (t.done() || to_move(t) != vtable.role()) continue;
+				int max_pos = -1;
+				double max_value = -numeric_limits<double>::infinity();
+				for (int pos = 0; pos<BOARD_SIZE; pos++) {
+					int next_id = all_states_ptr_->next(id, pos);
+					if (next_id >= 0 && max_value < vtable.value(next_id)) {
+						max_value = vtable.value(next_id);
+						max_pos = pos;
+					}
+				}
+				counts[worker].first += optimal(id, max_pos);
+				counts[worker].second++;
+			}
+		});
+		long long num_optimal = 0, num_states = 0;
+		for (auto &c : counts) { num_optimal += c.first; num_states += c.second; }
+		return num_states == 0 ? 1.0 : double(num_optimal) / num_states;
+	}
+};
+
+// Player
+template<int DIM>
+class Player {
+public:
+	virtual void reset() = 0;
+	virtual int  role() = 0;
+	virtual void role(int role) = 0;
+	virtual void state(const State<DIM>* pstate) = 0;
+	virtual void reward(double r) = 0;
+	virtual int  action() = 0; // position of the next move
+	virtual shared_ptr<ValueTable<DIM>> value_table() const = 0;
+	virtual void value_table(shared_ptr<ValueTable<DIM>> vtable) = 0;
+	// whether the player is shown, and moves on, the board as played instead of the table's canonical state
+	virtual bool real_board() const { return false; }
+};
+
+template<int DIM>
+class AIPlayer : public Player<DIM> {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+private:
+	int role_; // X or O
+	const StateTable<DIM>* all_states_ptr_;
+	shared_ptr<ValueTable<DIM>> value_table_; // shared with whoever handed it in, not copied
+	double step_size_;
+	double explore_rate_;
+	vector<const State<DIM>*> state_ptrs_;
+	uniform_real_distribution<double> unif_real_;
+	default_random_engine* generator_ = &global_generator;
+	BackupLog<DIM>* backup_log_ = nullptr;
+	long long num_backups_ = 0;
+public:
+	AIPlayer(int arole, const StateTable<DIM>* all_states, double step_size = 0.1, double explore_rate = 0.1, shared_ptr<ValueTable<DIM>> vtable = nullptr)
+		:step_size_(step_size), explore_rate_(explore_rate), all_states_ptr_(all_states), value_table_(vtable) {
+		role(arole);
+		state_ptrs_.reserve(BOARD_SIZE + 1);
+		unif_real_.param(uniform_real_distribution<double>::param_type(0.0, 1.0));
+	}
+	void reset() { state_ptrs_.clear(); }
+	int role() { return role_; }
+	void role(int role)
+	{
+		role_ = role;
+		// initialize value table unless we already hold one for this role
+		if (!value_table_ || value_table_->role() != role_)
+			value_table_ = make_shared<ValueTable<DIM>>(*all_states_ptr_, role_);
+	}
+	void generator(default_random_engine* gen) { generator_ = gen; }
+	// with a log the backups of finished games are recorded there instead of applied
+	void backup_log(BackupLog<DIM>* log) { backup_log_ = log; }
+	void state(const State<DIM>* pstate) { state_ptrs_.push_back(pstate); }
+	void reward(double r)
+	{
+		// update reward, learning
+		if (state_ptrs_.empty()) return;
+		num_backups_ += state_ptrs_.size();
+		if (backup_log_ != nullptr) {
+			backup_log_->record(value_table_.get(), r, step_size_, state_ptrs_);
+		}
+		else {
+			double target = r;
+			for (auto rit = state_ptrs_.rbegin(); rit != state_ptrs_.rend(); ++rit)
+				target = value_table_->backup((*rit)->id(), target, step_size_);
+		}
+		state_ptrs_.clear();
+	}
+	int action()
+	{
+		auto latest_state = state_ptrs_.back();
+		int possible_ids[BOARD_SIZE], possible_positions[BOARD_SIZE];
+		int num_possible = 0;
+		for (int pos = 0; pos<BOARD_SIZE; pos++) {
+			auto next_id = all_states_ptr_->next(latest_state->id(), pos);
+			if (next_id < 0) continue;
+			possible_ids[num_possible] = next_id;
+			possible_positions[num_possible++] = pos;
+		}
+		// check random pick
+		if (unif_real_(*generator_)<explore_rate_) {
+			uniform_int_distribution<int> unif_int(0, num_possible - 1);
+			auto i = unif_int(*generator_);
+			state_ptrs_.clear();
+			return possible_positions[i];
+		}
+
+		// pick the largest value
+		int max_pos = -1;
+		double max_value = INT64_MIN;
+		for (int i = 0; i<num_possible; i++) {
+			double value = value_table_->value(possible_ids[i]);
+			if (max_value<value) {
+				max_value = value;
+				max_pos = i;
+			}
+		}
+		return possible_positions[max_pos];
+	}
+	shared_ptr<ValueTable<DIM>> value_table() const { return value_table_; }
+	void value_table(shared_ptr<ValueTable<DIM>> vtable) { value_table_ = vtable; }
+	// number of TD backups made or recorded so far
+	long long backups() const { return num_backups_; }
+};
+
+template<int DIM>
+class HumanPlayer : public Player<DIM> {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+private:
+	int role_;
+	const State<DIM>* current_state_;
+public:
+	HumanPlayer(int arole) :current_state_(NULL) { role(arole); }
+	void reset() { current_state_ = NULL; }
+	int  role() { return role_; }
+	void role(int role) { role_ = role; }
+	void state(const State<DIM>* pstate) { current_state_ = pstate; }
+	void reward(double r) {}
+	int action()
+	{
+		int pos;
+		do {
+			// Ask human to input
+			cout << "Input your position:"; cin >> pos;
+			if (!cin) exit(0); // input closed
+		} while (pos < 0 || pos >= BOARD_SIZE || current_state_->value(pos) != BlankCell);
+		return pos;
+	}
+	shared_ptr<ValueTable<DIM>> value_table() const { return nullptr; }
+	void value_table(shared_ptr<ValueTable<DIM>> vtable) { }
+	bool real_board() const { return true; }
+};
+
+// Plays a uniformly random move among the optimal ones of a solved table, never loses a won or tied position
+template<int DIM>
+class PerfectPlayer : public Player<DIM> {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+private:
+	int role_;
+	const Solver<DIM>* solver_;
+	const State<DIM>* current_state_;
+	default_random_engine* generator_ = &global_generator;
+public:
+	PerfectPlayer(int arole, const Solver<DIM>* solver) :role_(arole), solver_(solver), current_state_(nullptr) {}
+	void reset() { current_state_ = nullptr; }
+	int  role() { return role_; }
+	void role(int role) { role_ = role; }
+	void generator(default_random_engine* gen) { generator_ = gen; }
+	void state(const State<DIM>* pstate) { current_state_ = pstate; }
+	void reward(double) {}
+	int action()
+	{
+		int optimal_positions[BOARD_SIZE];
+		int num_optimal = 0;
+		for (int pos = 0; pos<BOARD_SIZE; pos++)
+			if (solver_->optimal(current_state_->id(), pos)) optimal_positions[num_optimal++] = pos;
+		uniform_int_distribution<int> unif_int(0, num_optimal - 1);
+		return optimal_positions[unif_int(*generator_)];
+	}
+	shared_ptr<ValueTable<DIM>> value_table() const { return nullptr; }
+	void value_table(shared_ptr<ValueTable<DIM>>) { }
+};
+
+// Judge
+template<int DIM>
+class Judge {
+private:
+	Player<DIM> * player1_;
+	Player<DIM>* player2_;
+	Player<DIM>* current_player_;
+	bool feedback_;
+	const State<DIM>* current_state_;
+	const StateTable<DIM>* all_states_ptr_;
+	// a symmetric table only holds canonical states, so the board as played is tracked alongside for
+	// showing it and for players on the real board, with the symmetry that maps it to current_state_
+	bool track_board_ = false;
+	State<DIM> board_;
+	int sym_ = 0;
+	// plays the move of the current player on board_ and returns its position on current_state_
+	int move(int pos) {
+		int board_pos = pos, table_pos = pos;
+		if (current_player_->real_board()) table_pos = State<DIM>::symmetric_pos(pos, sym_);
+		else for (board_pos = 0; State<DIM>::symmetric_pos(board_pos, sym_) != pos; board_pos++);
+		int player = StateTable<DIM>::ply(board_.key()) % 2 == 0 ? PlayerX : PlayerO;
+		board_ = State<DIM>(board_.key() | State<DIM>::cell_bit(board_pos, player));
+		return table_pos;
+	}
+public:
+	Judge(const StateTable<DIM>* all_states, Player<DIM>* player1, Player<DIM>* player2, bool feedback = true)
+		:all_states_ptr_(all_states), player1_(player1), player2_(player2), feedback_(feedback), current_player_(nullptr)
+	{
+		current_state_ = all_states_ptr_->initial();
+	}
+	void reward()
+	{
+		if (current_state_->win() == player1_->role()) {
+			player1_->reward(1);
+			player2_->reward(0);
+		}
+		else if (current_state_->win() == player2_->role()) {
+			player1_->reward(0);
+			player2_->reward(1);
+		}
+		else {
+			player1_->reward(0.1);
+			player2_->reward(0.5);
+		}
+	}
+	void feed_current_state()
+	{
+		player1_->state(track_board_ && player1_->real_board() ? &board_ : current_state_);
+		player2_->state(track_board_ && player2_->real_board() ? &board_ : current_state_);
+	}
+	void reset()
+	{
+		player1_->reset();
+		player2_->reset();
+		current_player_ = nullptr;
+		current_state_ = all_states_ptr_->initial();
+		board_ = *current_state_;
+		sym_ = 0;
+	}
+	int play(bool show = false)
+	{
+		track_board_ = all_states_ptr_->symmetric() && (show || player1_->real_board() || player2_->real_board());
+		reset();
+		feed_current_state();
+		while (true) {
+			current_player_ = current_player_ == player1_ ? player2_ : player1_;
+			if (show) cout << (track_board_ ? board_ : *current_state_);
+			int pos = current_player_->action();
+			current_state_ = all_states_ptr_->next_state(*current_state_, track_board_ ? move(pos) : pos);
+			if (track_board_)
+				for (sym_ = 0; State<DIM>::transform(board_.key(), sym_) != current_state_->key(); sym_++);
+			feed_current_state();
+			if (current_state_->done()) {
+				if (feedback_) reward();
+				return current_state_->win();
+			}
+		}
+	}
+};
+
+// Lockstep engine: a batch of games between two learning policies with the same step size and explore
+// rate as AIPlayer advances one ply at a time, with all per-game data in struct-of-arrays layout. At every
+// ply all games have the same side to move, so move selection gathers the successor values of every game
+// into a [cell][game] matrix and takes a branch-free argmax over it that the compiler vectorizes across games.
+// The games of a batch learn when all of them are finished, so they all play against the same tables.
+template<int DIM>
+class BatchedGames {
+	enum { BOARD_DIM = DIM, BOARD_SIZE = DIM * DIM };
+private:
+	const StateTable<DIM>* all_states_;
+	ValueTable<DIM>* tables_[2]; // X, O
+	int batch_size_;
+	double step_size_;
+	double explore_rate_;
+	default_random_engine generator_;
+	uniform_real_distribution<double> unif_real_;
+	vector<int> states_;       //[game, current state id]
+	vector<int> lengths_;      //[game, # of states in its history]
+	vector<int> history_;      //[ply * batch + game, state id], from the initial state on
+	vector<int> first_[2];     //[role][game, first history entry the role learns from], reset by exploring
+	vector<double> values_;    //[cell * batch + game, value of the successor for the side to move or -inf]
+	vector<double> best_values_;
+	vector<int64_t> best_pos_;
+public:
+	BatchedGames(const StateTable<DIM>* all_states, ValueTable<DIM>* x_table, ValueTable<DIM>* o_table, int batch_size = 1024,
+		double step_size = 0.1, double explore_rate = 0.1, unsigned seed = 0)
+		:all_states_(all_states), batch_size_(batch_size), step_size_(step_size), explore_rate_(explore_rate),
+		generator_(seed), unif_real_(0.0, 1.0), states_(batch_size), lengths_(batch_size),
+		history_(size_t(BOARD_SIZE + 1) * batch_size), values_(size_t(BOARD_SIZE) * batch_size),
+		best_values_(batch_size), best_pos_(batch_size) {
+		tables_[0] = x_table;
+		tables_[1] = o_table;
+		first_[0].resize(batch_size);
+		first_[1].resize(batch_size);
+	}
+	// plays num_games games, learning from them if learn is set, and returns the wins of X and O
+	pair<int, int> play(int num_games, bool learn) {
+		pair<int, int> wins(0, 0);
+		for (int first = 0; first<num_games; first += batch_size_) {
+			auto w = play_batch(min(batch_size_, num_games - first), learn);
+			wins.first += w.first;
+			wins.second += w.second;
+		}
+		return wins;
+	}
+private:
+	pair<int, int> play_batch(int n, bool learn) {
+		const int B = batch_size_;
+		const double none = -numeric_limits<double>::infinity();
+		for (int g = 0; g<n; g++) {
+			states_[g] = history_[g] = 0;
+			lengths_[g] = 1;
+			first_[0][g] = first_[1][g] = 0;
+		}
+		for (int ply = 0; ply<BOARD_SIZE; ply++) {
+			const int role = ply % 2;
+			const ValueTable<DIM>& table = *tables_[role];
+			// gather, finished games have no successors
+			for (int g = 0; g<n; g++) {
+				const int* next = all_states_->successors(states_[g]);
+				for (int pos = 0; pos<BOARD_SIZE; pos++)
+					values_[size_t(pos) * B + g] = next[pos] < 0 ? none : table.value(next[pos]);
+			}
+			// argmax over cells for all games at once, first maximum wins like AIPlayer. isgreater() compares
+			// quietly, unlike >, which is what lets GCC turn both selects into masks at -O3 even on baseline
+			// SSE2, and positions are int64 so the mask of a double lane selects them as well.
+			for (int g = 0; g<n; g++) {
+				best_values_[g] = none;
+				best_pos_[g] = -1;
+			}
+			double* best_values = best_values_.data();
+			int64_t* best_pos = best_pos_.data();
+			for (int pos = 0; pos<BOARD_SIZE; pos++) {
+				const double* v = &values_[size_t(pos) * B];
+				for (int g = 0; g<n; g++) {
+					double best = best_values[g];
+					int64_t best_at = best_pos[g];
+					bool better = isgreater(v[g], best);
+					best_values[g] = better ? v[g] : best;
+					best_pos[g] = better ? pos : best_at;
+				}
+			}
+			// exploration mask, an exploring game picks a uniformly random free cell instead
+			int num_active = 0;
+			for (int g = 0; g<n; g++) {
+				if (best_pos_[g] < 0) continue;
+				num_active++;
+				if (explore_rate_ <= 0 || unif_real_(generator_) >= explore_rate_) continue;
+				int num_possible = 0;
+				for (int pos = 0; pos<BOARD_SIZE; pos++) num_possible += values_[size_t(pos) * B + g] != none;
+				int k = uniform_int_distribution<int>(0, num_possible - 1)(generator_);
+				for (int pos = 0; pos<BOARD_SIZE; pos++) {
+					if (values_[size_t(pos) * B + g] != none && k-- == 0) {
+						best_pos_[g] = pos;
+						break;
+					}
+				}
+				first_[role][g] = ply + 1;
+			}
+			if (num_active == 0) break;
+			for (int g = 0; g<n; g++) {
+				if (best_pos_[g] < 0) continue;
+				states_[g] = all_states_->next(states_[g], best_pos_[g]);
+				history_[size_t(ply + 1) * B + g] = states_[g];
+				lengths_[g] = ply + 2;
+			}
+		}
+		// rewards as given by Judge, then the TD backup of each side
+		pair<int, int> wins(0, 0);
+		for (int g = 0; g<n; g++) {
+			int winner = (*all_states_)[states_[g]].win();
+			double rewards[2] = { 0.1, 0.5 };
+			if (winner == WinnerX) { rewards[0] = 1; rewards[1] = 0; wins.first++; }
+			if (winner == WinnerO) { rewards[0] = 0; rewards[1] = 1; wins.second++; }
+			if (!learn) continue;
+			for (int role = 0; role<2; role++) {
+				double target = rewards[role];
+				for (int i = lengths_[g] - 1; i >= first_[role][g]; i--)
+					target = tables_[role]->backup(history_[size_t(i) * B + g], target, step_size_);
+			}
+		}
+		return wins;
+	}
+};
+
+// Binary snapshot of a TicTacToe: this header, then 64-byte aligned sections holding the states as they are
+// laid out in memory, the successor ids, the (ply, shard) ranges, and one block per value table made of the
+// table's role as an int64 followed by its values. Only a build with the same version, board dimension and
+// State layout loads a snapshot, which is also assumed to come from a machine of the same byte order.
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t dim;
+	uint32_t symmetric;
+	uint32_t state_size;
+	uint64_t num_states;
+	uint32_t num_tables;
+	uint32_t reserved;
+
+	static const uint32_t Version = 2;
+	static const char* magic_value() { return "RLAITTT"; }
+	static size_t align(size_t offset) { return (offset + 63) / 64 * 64; }
+	size_t num_ranges() const { return (dim * dim + 1) * 64 + 1; }
+	size_t states_offset() const { return align(sizeof(SnapshotHeader)); }
+	size_t next_offset() const { return align(states_offset() + num_states * state_size); }
+	size_t ranges_offset() const { return align(next_offset() + num_states * dim * dim * sizeof(int32_t)); }
+	size_t table_size() const { return align(sizeof(int64_t) + num_states * sizeof(double)); }
+	size_t table_offset(int i) const { return align(ranges_offset() + num_ranges() * sizeof(int32_t)) + i * table_size(); }
+	size_t file_size() const { return table_offset(num_tables); }
+};
+static_assert(sizeof(int) == sizeof(int32_t), "snapshots store successor ids as int32");
+
+template<int DIM>
+class TicTacToe
+{
+private:
+	StateTable<DIM>* all_states_=NULL;
+	unordered_map<int, shared_ptr<ValueTable<DIM>> > value_tables; //[player role, estimated values by state id]
+	atomic<long long> num_backups_{ 0 }; // TD backups made by self-play
+	void init_value_tables()
+	{
+		for (int role : { PlayerX, PlayerO })
+			if (!value_tables[role]) value_tables[role] = make_shared<ValueTable<DIM>>(*all_states_, role);
+	}
+	// Plays games [first, last) between two learning AIPlayers on the value tables of X and O and returns
+	// their wins. With a log, backups are recorded there and every game reseeds the generator from
+	// (seed, game number). The tables are handed in, workers never touch the value_tables map.
+	pair<int, int> self_play(shared_ptr<ValueTable<DIM>> x_table, shared_ptr<ValueTable<DIM>> o_table, int first, int last,
+		default_random_engine& generator, unsigned seed, BackupLog<DIM>* log, bool verbose)
+	{
+		AIPlayer<DIM> player1(PlayerX, all_states_, 0.1, 0.1, x_table);
+		AIPlayer<DIM> player2(PlayerO, all_states_, 0.1, 0.1, o_table);
+		player1.generator(&generator);
+		player2.generator(&generator);
+		player1.backup_log(log);
+		player2.backup_log(log);
+		Judge<DIM> judge(all_states_, &player1, &player2);
+		pair<int, int> wins(0, 0);
+		for (int i = first; i<last; i++) {
+			if (verbose && i % 100 == 0) cout << "Epoch " << i << ": " << endl;
+			if (log != nullptr) {
+				seed_seq game_seed{ seed, unsigned(i) };
+				generator.seed(game_seed);
+			}
+			int winner = judge.play();
+			if (winner == player1.role()) wins.first += 1;
+			if (winner == player2.role()) wins.second += 1;
+			judge.reset();
+			all_states_->collect();
+		}
+		num_backups_ += player1.backups() + player2.backups();
+		return wins;
+	}
+public:
+	// symmetric: learn one value per symmetry class, boards are still shown as played
+	// snapshot: file written by save() to map instead of enumerating the states, its value tables included
+	// cache_mb: create states lazily in a cache of this many MB instead, for boards too large to enumerate
+	TicTacToe(bool symmetric = false, const string& snapshot = "", size_t cache_mb = 0) {
+		if (cache_mb > 0) all_states_ = StateTable<DIM>::create_lazy_states(symmetric, cache_mb << 20);
+		else if (snapshot.empty() || !load(snapshot, symmetric)) all_states_ = StateTable<DIM>::create_all_states(symmetric);
+	}
+	bool lazy() const { return all_states_->lazy(); }
+	~TicTacToe() {
+		if (all_states_ != NULL) delete all_states_;
+	}
+	// Keeps learning on the tables of an earlier train() call if there is one, and returns games/sec.
+	// num_workers > 1 (0 for all cores) plays the games on that many threads that all update the shared
+	// tables without locks. deterministic plays rounds of games against frozen tables, game i drawing
+	// from its own stream seeded by (seed, i), and applies their backups in game order afterwards,
+	// so the result does not depend on the number of workers or on thread scheduling.
+	double train(int epochs = 20000, int num_workers = 1, bool deterministic = false, unsigned seed = 0)
+	{
+		if (num_workers <= 0) num_workers = max(1u, thread::hardware_concurrency());
+		// a lazy table changes its slots during play, which only a single sequential player can follow;
+		// the command line rejects --deterministic and warns about --workers before it gets here
+		if (lazy()) {
+			num_workers = 1;
+			deterministic = false;
+		}
+		init_value_tables();
+		auto x_table = value_tables[PlayerX], o_table = value_tables[PlayerO];
+		vector<pair<int, int>> wins(num_workers, make_pair(0, 0));
+		auto start = chrono::steady_clock::now();
+		if (deterministic) {
+			const int round = 1024;
+			vector<BackupLog<DIM>> logs(num_workers);
+			for (int first = 0; first<epochs; first += round) {
+				parallel_for(min(round, epochs - first), num_workers, [&](int begin, int end, int worker) {
+					default_random_engine generator;
+					auto w = self_play(x_table, o_table, first + begin, first + end, generator, seed, &logs[worker], false);
+					wins[worker].first += w.first;
+					wins[worker].second += w.second;
+				});
+				// contiguous chunks per worker, so this is game order
+				for (auto &log : logs) log.apply();
+			}
+		}
+		else if (num_workers > 1) {
+			parallel_for(epochs, num_workers, [&](int begin, int end, int worker) {
+				seed_seq worker_seed{ seed, unsigned(worker) };
+				default_random_engine generator(worker_seed);
+				wins[worker] = self_play(x_table, o_table, begin, end, generator, seed, nullptr, false);
+			});
+		}
+		else {
+			wins[0] = self_play(x_table, o_table, 0, epochs, global_generator, seed, nullptr, true);
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		double player1_win = 0, player2_win = 0;
+		for (auto &w : wins) {
+			player1_win += w.first;
+			player2_win += w.second;
+		}
+		cout << "Player 1 Win : " << player1_win / epochs << endl;
+		cout << "Player 2 Win : " << player2_win / epochs << endl;
+		cout << "Games/sec : " << epochs / seconds << " (" << num_workers << " workers)" << endl;
+		if (lazy()) all_states_->print_cache();
+		return epochs / seconds;
+	}
+	int num_states() const { return all_states_->size(); }
+	// forgets everything learned, the next train() starts from the initial values
+	void clear_values() { value_tables.clear(); }
+	long long backups() const { return num_backups_; }
+	// trains from scratch with 1, 2, 4, ... workers up to the number of cores and reports the speedup
+	void train_scaling(int epochs, bool deterministic = false, unsigned seed = 0)
+	{
+		int max_workers = max(1u, thread::hardware_concurrency());
+		double base_rate = 0;
+		for (int w = 1; ; w = min(2 * w, max_workers)) {
+			clear_values();
+			double rate = train(epochs, w, deterministic, seed);
+			if (w == 1) base_rate = rate;
+			cout << "Workers " << w << ": " << rate << " games/sec, speedup " << rate / base_rate << endl;
+			if (w == max_workers) break;
+		}
+	}
+	// Writes the states and the value tables to path. The file is written aside and renamed into place,
+	// so processes that have the old snapshot mapped keep seeing it unchanged.
+	bool save(const string& path)
+	{
+		static_assert(is_trivially_copyable<State<DIM>>::value, "states are stored as they are laid out in memory");
+		// both tables always, untrained ones at their initial values, so load() can insist on both
+		init_value_tables();
+		vector<shared_ptr<ValueTable<DIM>>> tables = { value_tables[PlayerX], value_tables[PlayerO] };
+		SnapshotHeader header = SnapshotHeader();
+		memcpy(header.magic, SnapshotHeader::magic_value(), sizeof(header.magic));
+		header.version = SnapshotHeader::Version;
+		header.dim = DIM;
+		header.symmetric = all_states_->symmetric();
+		header.state_size = sizeof(State<DIM>);
+		header.num_states = all_states_->size();
+		header.num_tables = (uint32_t)tables.size();
+
+		string tmp_path = path + ".tmp";
+		ofstream out(tmp_path, ios::binary);
+		auto write_at = [&](size_t offset, const void* data, size_t size) {
+			while ((size_t)out.tellp() < offset) out.put(0);
+			out.write((const char*)data, size);
+		};
+		size_t n = all_states_->size();
+		write_at(0, &header, sizeof(header));
+		write_at(header.states_offset(), all_states_->states(), n * sizeof(State<DIM>));
+		write_at(header.next_offset(), all_states_->successors(0), n * DIM * DIM * sizeof(int));
+		write_at(header.ranges_offset(), all_states_->ranges(), header.num_ranges() * sizeof(int));
+		for (size_t i = 0; i<tables.size(); i++) {
+			int64_t role = tables[i]->role();
+			write_at(header.table_offset((int)i), &role, sizeof(role));
+			vector<double> values(n);
+			tables[i]->copy_values(values.data());
+			out.write((const char*)values.data(), n * sizeof(double));
+		}
+		write_at(header.file_size(), nullptr, 0);
+		out.close();
+#ifdef _WIN32
+		if (out) remove(path.c_str());
+#endif
+		if (!out || rename(tmp_path.c_str(), path.c_str()) != 0) {
+			remove(tmp_path.c_str());
+			cout << "Cannot write snapshot " << path << endl;
+			return false;
+		}
+		cout << "Saved snapshot " << path << endl;
+		return true;
+	}
+	// Maps a snapshot written by save(), false if it cannot be read, is damaged or does not fit this build
+	bool load(const string& path, bool symmetric)
+	{
+		auto start = chrono::steady_clock::now();
+		auto file = MappedFile::open(path);
+		SnapshotHeader header;
+		if (!file || file->size() < sizeof(header)) {
+			cout << "Cannot read snapshot " << path << endl;
+			return false;
+		}
+		memcpy(&header, file->data(), sizeof(header));
+		if (memcmp(header.magic, SnapshotHeader::magic_value(), sizeof(header.magic)) != 0 ||
+			header.version != SnapshotHeader::Version || header.dim != DIM || header.state_size != sizeof(State<DIM>) ||
+			header.symmetric != (uint32_t)symmetric) {
+			cout << "Snapshot " << path << " does not fit this build or these options, ignored" << endl;
+			return false;
+		}
+		// the counts are bounded by the file before any offset is computed from them, so these cannot overflow
+		if (header.num_tables != 2 || header.num_states == 0 || header.num_states > (uint64_t)numeric_limits<int>::max() ||
+			header.num_states > file->size() / sizeof(State<DIM>) || file->size() < header.file_size()) {
+			cout << "Snapshot " << path << " is damaged, ignored" << endl;
+			return false;
+		}
+		char* base = file->data();
+		int n = (int)header.num_states;
+		int64_t roles[2];
+		for (int i = 0; i<2; i++) memcpy(&roles[i], base + header.table_offset(i), sizeof(roles[i]));
+		if (!((roles[0] == PlayerX && roles[1] == PlayerO) || (roles[0] == PlayerO && roles[1] == PlayerX))) {
+			cout << "Snapshot " << path << " does not hold the value tables of X and O, ignored" << endl;
+			return false;
+		}
+		auto all_states = new StateTable<DIM>(symmetric, file, (State<DIM>*)(base + header.states_offset()), n,
+			(int*)(base + header.next_offset()), (int*)(base + header.ranges_offset()));
+		if (!all_states->consistent()) {
+			delete all_states;
+			cout << "Snapshot " << path << " is damaged, ignored" << endl;
+			return false;
+		}
+		all_states_ = all_states;
+		value_tables.clear();
+		for (int i = 0; i<2; i++) {
+			char* block = base + header.table_offset(i);
+			value_tables[(int)roles[i]] = make_shared<ValueTable<DIM>>((int)roles[i], file, (double*)(block + sizeof(roles[i])), n);
+		}
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		cout << "Loaded snapshot " << path << ": " << n << " states, " << header.num_tables << " value tables in " << ms << " ms" << endl;
+		return true;
+	}
+	// same as train() with one worker, but all games run on the BatchedGames engine
+	double train_batched(int epochs = 20000, int batch_size = 1024, unsigned seed = 0)
+	{
+		init_value_tables();
+		BatchedGames<DIM> games(all_states_, value_tables[PlayerX].get(), value_tables[PlayerO].get(), batch_size, 0.1, 0.1, seed);
+		auto start = chrono::steady_clock::now();
+		auto wins = games.play(epochs, true);
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Player 1 Win : " << double(wins.first) / epochs << endl;
+		cout << "Player 2 Win : " << double(wins.second) / epochs << endl;
+		cout << "Games/sec : " << epochs / seconds << " (batches of " << batch_size << ")" << endl;
+		return epochs / seconds;
+	}
+	void compete_batched(int turns = 500)
+	{
+		init_value_tables();
+		BatchedGames<DIM> games(all_states_, value_tables[PlayerX].get(), value_tables[PlayerO].get(), 1024, 0.1, 0);
+		auto wins = games.play(turns, false);
+		cout << "Player 1 Win : " << double(wins.first) / turns << endl;
+		cout << "Player 2 Win : " << double(wins.second) / turns << endl;
+	}
+	void compete(int turns = 500)
+	{
+		AIPlayer<DIM> player1(PlayerX, all_states_, 0.1, 0, value_tables[PlayerX]);
+		AIPlayer<DIM> player2(PlayerO, all_states_, 0.1, 0, value_tables[PlayerO]);
+		Judge<DIM> judge(all_states_, &player1, &player2, false);
+		double player1_win = 0, player2_win = 0;
+		for (int i = 0; i<turns; i++) {
+			if (i % 100 == 0) cout << "Epoch " << i << ": " << endl;
+			int winner = judge.play();
+			if (winner == player1.role()) player1_win += 1;
+			if (winner == player2.role()) player2_win += 1;
+			judge.reset();
+			all_states_->collect();
+		}
+		cout << "Player 1 Win : " << player1_win / turns << endl;
+		cout << "Player 2 Win : " << player2_win / turns << endl;
+	}
+	// Exact evaluation of the learned tables: solve the game, report how often each greedy policy is
+	// optimal over all states where it moves, then let the greedy players meet a perfect opponent
+	void evaluate(int turns = 1000, int num_workers = 0)
+	{
+		init_value_tables();
+		auto start = chrono::steady_clock::now();
+		Solver<DIM> solver(all_states_, num_workers);
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		int value = solver.outcome(all_states_->initial()->id());
+		cout << "Solved " << all_states_->size() << " states in " << ms << " ms, game value : "
+			<< (value == WinnerX ? "Player 1 Win" : value == WinnerO ? "Player 2 Win" : "Tie") << endl;
+		cout << "Player 1 optimal moves : " << solver.policy_optimality(*value_tables[PlayerX], num_workers) << endl;
+		cout << "Player 2 optimal moves : " << solver.policy_optimality(*value_tables[PlayerO], num_workers) << endl;
+		if (turns <= 0) return;
+
+		AIPlayer<DIM> player1(PlayerX, all_states_, 0.1, 0, value_tables[PlayerX]);
+		AIPlayer<DIM> player2(PlayerO, all_states_, 0.1, 0, value_tables[PlayerO]);
+		PerfectPlayer<DIM> perfect1(PlayerX, &solver), perfect2(PlayerO, &solver);
+		Judge<DIM> judge1(all_states_, &player1, &perfect2, false), judge2(all_states_, &perfect1, &player2, false);
+		double player1_loss = 0, player2_loss = 0;
+		for (int i = 0; i<turns; i++) {
+			if (judge1.play() == WinnerO) player1_loss += 1;
+			if (judge2.play() == WinnerX) player2_loss += 1;
+		}
+		cout << "Player 1 Lose vs perfect : " << player1_loss / turns << endl;
+		cout << "Player 2 Lose vs perfect : " << player2_loss / turns << endl;
+	}
+	void play()
+	{
+		while (true) {
+			AIPlayer<DIM> ai_player(PlayerX, all_states_, 0.1, 0, value_tables[PlayerX]);
+			HumanPlayer<DIM> man_player(PlayerO);
+			Judge<DIM> judge(all_states_, &ai_player, &man_player, false);
+			int winner = judge.play(true);
+			if (winner == ai_player.role()) cout << " Lose !" << endl;
+			else if (winner == man_player.role()) cout << " Win !" << endl;
+			else cout << " Tie !" << endl;
+			all_states_->collect();
+		}
+	}
+};
+
+// stream buffer that drops everything written to it
+class NullBuffer : public streambuf {
+protected:
+	int overflow(int c) { return c; }
+};
+
+// silences cout while in scope
+class SilentCout {
+private:
+	NullBuffer null_;
+	streambuf* old_;
+public:
+	SilentCout() : old_(cout.rdbuf(&null_)) {}
+	~SilentCout() { cout.rdbuf(old_); }
+};
+
+// peak resident set size of the process so far in KB, 0 where it is not available. VmHWM is read in
+// the same units as current_rss_kb(), ru_maxrss is only the fallback where /proc/self/status is missing.
+long peak_rss_kb()
+{
+#ifdef _WIN32
+	return 0;
+#else
+	long peak = 0;
+	FILE* status = fopen("/proc/self/status", "r");
+	if (status != nullptr) {
+		char line[256];
+		while (fgets(line, sizeof(line), status) != nullptr)
+			if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) break;
+		fclose(status);
+	}
+	if (peak > 0) return peak;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#endif
+}
+
+// current resident set size of the process in KB, 0 where /proc/self/statm is not available
+long current_rss_kb()
+{
+#ifdef _WIN32
+	return 0;
+#else
+	long pages = 0, resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm == nullptr) return 0;
+	if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(statm);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
+
+// Timings of the repeated runs of one benchmark phase and the work done by one run, e.g. games
+struct BenchmarkPhase {
+	string name;
+	int dim;
+	vector<double> seconds;
+	vector<pair<string, double>> work; // whole units, printed as integers
+	long rss_before_kb, rss_after_kb; // before the warm-up run and after the timed runs of this phase
+	long process_peak_rss_kb;         // since the process started, so it includes the phases before
+	// p-th percentile of the run times, interpolated between neighbouring ranks
+	double percentile(double p) const {
+		vector<double> sorted = seconds;
+		sort(sorted.begin(), sorted.end());
+		double rank = p / 100 * (sorted.size() - 1);
+		size_t lo = (size_t)rank, hi = min(lo + 1, sorted.size() - 1);
+		return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+	}
+	// rates are work per second at the median run time
+	string json() const {
+		ostringstream out;
+		out << "{\"name\": \"" << name << "\", \"dim\": " << dim << ", \"runs\": " << seconds.size()
+			<< ", \"median_s\": " << percentile(50) << ", \"p10_s\": " << percentile(10) << ", \"p90_s\": " << percentile(90)
+			<< ", \"min_s\": " << percentile(0) << ", \"max_s\": " << percentile(100);
+		for (auto &w : work)
+			out << ", \"" << w.first << "\": " << (long long)w.second << ", \"" << w.first << "_per_s\": " << w.second / percentile(50);
+		out << ", \"rss_before_kb\": " << rss_before_kb << ", \"rss_after_kb\": " << rss_after_kb
+			<< ", \"process_peak_rss_kb\": " << process_peak_rss_kb << "}";
+		return out.str();
+	}
+};
+
+// Runs fn once to warm up, then repeat times with cout silenced; fn returns the work done by one run.
+// Memory fn still holds when it returns shows in rss_after_kb.
+template<class Fn>
+BenchmarkPhase measure(const string& name, int dim, int repeat, Fn fn)
+{
+	BenchmarkPhase phase;
+	phase.name = name;
+	phase.dim = dim;
+	SilentCout silent;
+	phase.rss_before_kb = current_rss_kb();
+	fn();
+	for (int i = 0; i<repeat; i++) {
+		auto start = chrono::steady_clock::now();
+		phase.work = fn();
+		phase.seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	phase.rss_after_kb = current_rss_kb();
+	phase.process_peak_rss_kb = max(peak_rss_kb(), phase.rss_after_kb);
+	return phase;
+}
+
+// Benchmarks enumeration, deterministic training, the sampled competition and the exact evaluation.
+// The table of the last enumeration run is only freed after the phase is measured, so the RSS after
+// enumeration includes the footprint of one state table.
+template<int DIM>
+void benchmark(int repeat, int num_workers, unsigned seed, vector<BenchmarkPhase>& phases)
+{
+	typedef vector<pair<string, double>> Work;
+	const int epochs = 20000, turns = 1000;
+	unique_ptr<StateTable<DIM>> enumerated;
+	phases.push_back(measure("enumerate", DIM, repeat, [&]() {
+		enumerated.reset();
+		enumerated.reset(StateTable<DIM>::create_all_states(false, num_workers));
+		return Work{ { "states", enumerated->size() } };
+	}));
+	enumerated.reset();
+	unique_ptr<TicTacToe<DIM>> tic;
+	{
+		SilentCout silent;
+		tic.reset(new TicTacToe<DIM>());
+	}
+	phases.push_back(measure("train", DIM, repeat, [&]() {
+		tic->clear_values();
+		long long backups = tic->backups();
+		tic->train(epochs, num_workers, true, seed);
+		return Work{ { "games", epochs }, { "td_updates", double(tic->backups() - backups) } };
+	}));
+	phases.push_back(measure("compete", DIM, repeat, [&]() {
+		global_generator.seed(seed);
+		tic->compete(turns);
+		return Work{ { "games", turns } };
+	}));
+	phases.push_back(measure("evaluate", DIM, repeat, [&]() {
+		tic->evaluate(0, num_workers);
+		return Work{ { "states", tic->num_states() } };
+	}));
+}
+
+// command line options
+struct Options {
+	int dim = 3;
+	bool symmetric = false;
+	bool deterministic = false;
+	bool scaling = false;
+	bool batched = false;
+	bool solve = false;
+	int num_workers = 1;
+	unsigned seed = 0;
+	int epochs = 100000;
+	string load, save;
+	bool benchmark = false;
+	int repeat = 5;
+	size_t cache_mb = 0; // lazy state cache, required from 5x5 on
+};
+
+template<int DIM>
+void run(const Options& opt)
+{
+	TicTacToe<DIM> tic(opt.symmetric, opt.load, opt.cache_mb);
+	// the batched engine, the solver and snapshots need the whole enumerated state table
+	bool lazy = tic.lazy();
+	if (lazy && (opt.scaling || opt.batched || opt.solve || !opt.save.empty() || !opt.load.empty()))
+		cout << "Lazy states: --scaling, --batched, --solve, --save and --load are ignored" << endl;
+	if (opt.epochs > 0) {
+		if (opt.scaling && !lazy) tic.train_scaling(opt.epochs, opt.deterministic, opt.seed);
+		else if (opt.batched && !lazy) tic.train_batched(opt.epochs, 1024, opt.seed);
+		else tic.train(opt.epochs, opt.num_workers, opt.deterministic, opt.seed);
+	}
+	if (!opt.save.empty() && !lazy) tic.save(opt.save);
+	if (opt.solve && !lazy) tic.evaluate(1000, opt.num_workers);
+	else if (opt.batched && !lazy) tic.compete_batched(1000);
+	else tic.compete(1000);
+	tic.play();
+}
+
+int main(int argc, char* argv[])
+{
+	Options opt;
+	for (int i = 1; i<argc; i++) {
+		string arg = argv[i];
+		if (arg == "--symmetric") opt.symmetric = true;
+		else if (arg == "--deterministic") opt.deterministic = true;
+		else if (arg == "--scaling") opt.scaling = true;
+		else if (arg == "--batched") opt.batched = true;
+		else if (arg == "--solve") opt.solve = true;
+		else if (arg == "--dim" && i + 1<argc) opt.dim = atoi(argv[++i]);
+		else if (arg == "--workers" && i + 1<argc) opt.num_workers = atoi(argv[++i]);
+		else if (arg == "--seed" && i + 1<argc) opt.seed = (unsigned)atoi(argv[++i]);
+		else if (arg == "--epochs" && i + 1<argc) opt.epochs = atoi(argv[++i]);
+		else if (arg == "--load" && i + 1<argc) opt.load = argv[++i];
+		else if (arg == "--save" && i + 1<argc) opt.save = argv[++i];
+		else if (arg == "--benchmark") opt.benchmark = true;
+		else if (arg == "--repeat" && i + 1<argc) opt.repeat = max(1, atoi(argv[++i]));
+		else if (arg == "--cache" && i + 1<argc) opt.cache_mb = (size_t)max(0, atoi(argv[++i]));
+	}
+	if (opt.benchmark) {
+		// JSON report on stdout, every phase at 3x3 and 4x4
+		vector<BenchmarkPhase> phases;
+		benchmark<3>(opt.repeat, opt.num_workers, opt.seed, phases);
+		benchmark<4>(opt.repeat, opt.num_workers, opt.seed, phases);
+		cout << "{\"workers\": " << opt.num_workers << ", \"seed\": " << opt.seed << ", \"benchmarks\": [" << endl;
+		for (size_t i = 0; i<phases.size(); i++) cout << "  " << phases[i].json() << (i + 1<phases.size() ? "," : "") << endl;
+		cout << "]}" << endl;
+		return 0;
+	}
+	if (opt.dim < 3 || opt.dim > 5) {
+		cout << "Unsupported --dim " << opt.dim << ", the board dimension has to be 3, 4 or 5" << endl;
+		return 1;
+	}
+	if (opt.dim == 5 && opt.cache_mb == 0) opt.cache_mb = 1024;
+	// lazy states can only be followed by one sequential player, see train()
+	if (opt.cache_mb > 0 && opt.deterministic) {
+		cout << "--deterministic needs the enumerated state table and cannot run with lazy states (--cache or --dim 5)" << endl;
+		return 1;
+	}
+	if (opt.cache_mb > 0 && opt.num_workers != 1)
+		cout << "Lazy states: training runs on one worker, --workers is ignored" << endl;
+	// one instantiation per supported board dimension
+	if (opt.dim == 5) run<5>(opt);
+	else if (opt.dim == 4) run<4>(opt);
+	else run<3>(opt);
+	return 0;
+}
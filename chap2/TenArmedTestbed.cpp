@@ -25,13 +25,156 @@
 #include <algorithm>
 #include <functional>
 #include <exception>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <cstdlib>
+#include <sstream>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 using namespace std;
 
+// Heap allocations are counted while count_allocations is set, so the benchmark can report allocations
+// per step; every other run only pays a test of the flag. All forms of operator new and delete are
+// replaced together, so none of them pairs a counted allocation with the library's deallocation.
+bool count_allocations = false;
+atomic<long long> heap_allocations(0);
+
+inline void* counted_malloc(size_t size)
+{
+	if (count_allocations) heap_allocations.fetch_add(1, memory_order_relaxed);
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw bad_alloc();
+}
+void* operator new(size_t size) { return counted_malloc(size); }
+void* operator new[](size_t size) { return counted_malloc(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+#ifdef __cpp_aligned_new
+inline void* counted_aligned_malloc(size_t size, align_val_t alignment)
+{
+	if (count_allocations) heap_allocations.fetch_add(1, memory_order_relaxed);
+	size_t align = max(size_t(alignment), sizeof(void*));
+#ifdef _WIN32
+	if (void* p = _aligned_malloc(size ? size : 1, align)) return p;
+#else
+	void* p = nullptr;
+	if (posix_memalign(&p, align, size ? size : 1) == 0) return p;
+#endif
+	throw bad_alloc();
+}
+inline void aligned_free(void* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+void* operator new(size_t size, align_val_t alignment) { return counted_aligned_malloc(size, alignment); }
+void* operator new[](size_t size, align_val_t alignment) { return counted_aligned_malloc(size, alignment); }
+void operator delete(void* p, align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, align_val_t) noexcept { aligned_free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { aligned_free(p); }
+#endif
+
+// Action selection of a bandit, picked once per configuration so every policy runs its own kernel.
+// Optimistic initial values are plain Greedy; every policy but Greedy explores when epsilon > 0.
+enum BanditPolicy { Greedy, EpsilonGreedy, Ucb, Gradient };
+
+// Argmax over arms of q[i] + c * s[i] for a c that never decreases: the UCB coefficient, or 0 without
+// s for greedy selection. A tournament tree keeps the winner of every subtree, so when one arm changes only
+// the matches on its path to the root are replayed, O(log k) instead of a scan over all arms. As c grows the
+// loser of a match overtakes the winner at one c if its s is larger; every node keeps the smallest such c in
+// its subtree, and raising c replays only the matches that run out (a kinetic tournament). Ties go to the
+// lower arm, so the winner is the first maximum like max_element and the scans in Bandit::action.
+class ArgmaxTree
+{
+private:
+	int leaves_ = 0;
+	double c_ = 0;
+	vector<int> winner_;    //[node], node 1 is the root and leaf i is node leaves_ + i, -1 past the last arm
+	vector<double> expiry_; //[node], the smallest c at which a match in the subtree may change its winner
+	// same expression as the scans so that the comparisons agree bit for bit
+	inline double value(const double* q, const double* s, int i) const { return s ? q[i] + c_ * s[i] : q[i]; }
+	void match(int node, const double* q, const double* s) {
+		int l = winner_[2 * node], r = winner_[2 * node + 1];
+		double expiry = min(expiry_[2 * node], expiry_[2 * node + 1]);
+		if (r < 0 || l < 0) {
+			winner_[node] = r < 0 ? l : r;
+			expiry_[node] = expiry;
+			return;
+		}
+		int w = value(q, s, r) > value(q, s, l) ? r : l, loser = w == l ? r : l;
+		winner_[node] = w;
+		if (s && s[loser] > s[w]) {
+			// certificate of the match, kept a little early so that rounding never lets a stale winner through
+			double cross = (q[w] - q[loser]) / (s[loser] - s[w]);
+			expiry = min(expiry, max(c_, cross - 1e-6 * (fabs(cross) + 1)));
+		}
+		expiry_[node] = expiry;
+	}
+	void refresh(int node, const double* q, const double* s) {
+		if (node >= leaves_ || expiry_[node] >= c_) return;
+		refresh(2 * node, q, s);
+		refresh(2 * node + 1, q, s);
+		match(node, q, s);
+	}
+public:
+	// tree over arms [0, k) with coefficient c
+	void build(int k, const double* q, const double* s, double c = 0) {
+		c_ = c;
+		for (leaves_ = 1; leaves_<k; leaves_ *= 2);
+		winner_.assign(2 * leaves_, -1);
+		expiry_.assign(2 * leaves_, HUGE_VAL);
+		for (int i = 0; i<k; i++) winner_[leaves_ + i] = i;
+		for (int node = leaves_ - 1; node>0; node--) match(node, q, s);
+	}
+	// after q[i] or s[i] changed
+	void update(int i, const double* q, const double* s) {
+		for (int node = (leaves_ + i) / 2; node>0; node /= 2) match(node, q, s);
+	}
+	// the argmax at coefficient c, no smaller than the last one
+	int argmax(double c, const double* q, const double* s) {
+		c_ = c;
+		if (leaves_ > 1 && expiry_[1] < c_) refresh(1, q, s);
+		return winner_[1];
+	}
+};
+
+// from how many arms a Bandit selects greedy and UCB actions by an ArgmaxTree instead of a scan
+const int ArgmaxTreeArms = 64;
+
 class Bandit
 {
+	friend class BatchedBandits;
 private:
 	vector<double> action_prob_;
+	vector<double> ucb_scale_; // 1 / sqrt(action count + 1) for each action
+	double initial_;           // estimate every action starts from
 	default_random_engine rnd_engine;
+	ArgmaxTree argmax_;        // of q_est_, plus the UCB bonus with ucb_param_, if tracks_argmax()
+	// rebuilds argmax_ once the estimates or the counts were reset
+	void reset_argmax()
+	{
+		if (tracks_argmax()) argmax_.build(k_, q_est_.data(), ucb_param_ ? ucb_scale_.data() : NULL);
+	}
 public:
 	int k_;
 	double step_size_;
@@ -42,6 +185,7 @@ public:
 	bool gradient_baseline_;
 	double average_reward_;
 	double true_reward_;
+	double random_walk_ = 0;  // standard deviation of the steps of the true values, 0 for a stationary bandit
 	vector<double> q_true_;   // real reward for each action
 	vector<double> q_est_;    // estimated reward for each action
 	vector<int> action_count_; // count of chosen for each action
@@ -54,7 +198,10 @@ public:
 		gradient_(gradient), gradient_baseline_(gradientBaseline), true_reward_(trueReward)
 	{
 		time_step_ = 0;
+		initial_ = initial;
 		q_est_.resize(k_, 0);
+		action_prob_.resize(k_, 0);
+		ucb_scale_.resize(k_, 1);
 		normal_distribution<double> norm_dist(0, 1);
 		for (int i = 0; i<k_; i++) {
 			q_true_.push_back(norm_dist(rnd_engine) + true_reward_);
@@ -62,29 +209,80 @@ public:
 			action_count_.push_back(0);
 		}
 		best_action_ = distance(q_true_.begin(), max_element(q_true_.begin(), q_true_.end()));
+		reset_argmax();
 	}
+	// restarts the bandit on new true values drawn from a generator seeded by seq, keeping its configuration
+	// and forgetting what it learned. The true values of a random walk all start at true_reward_ (exercise 2.5).
+	void seed(seed_seq& seq)
+	{
+		rnd_engine.seed(seq);
+		normal_distribution<double> norm_dist(0, 1);
+		for (int i = 0; i<k_; i++) q_true_[i] = (random_walk_ > 0 ? 0 : norm_dist(rnd_engine)) + true_reward_;
+		best_action_ = distance(q_true_.begin(), max_element(q_true_.begin(), q_true_.end()));
+		time_step_ = 0;
+		average_reward_ = 0;
+		fill(q_est_.begin(), q_est_.end(), initial_);
+		fill(action_prob_.begin(), action_prob_.end(), 0.0);
+		fill(action_count_.begin(), action_count_.end(), 0);
+		fill(ucb_scale_.begin(), ucb_scale_.end(), 1.0);
+		reset_argmax();
+	}
+	BanditPolicy policy() const
+	{
+		if (gradient_) return Gradient;
+		if (ucb_param_ != NULL) return Ucb;
+		return epsilon_>0 ? EpsilonGreedy : Greedy;
+	}
+	// whether greedy and UCB actions come from argmax_, which pays off with many arms; the gradient
+	// bandit changes every estimate each step and keeps its scan
+	bool tracks_argmax() const { return k_ >= ArgmaxTreeArms && !gradient_; }
+	int action()
+	{
+		switch (policy()) {
+		case Greedy: return action<Greedy>();
+		case EpsilonGreedy: return action<EpsilonGreedy>();
+		case Ucb: return action<Ucb>();
+		default: return action<Gradient>();
+		}
+	}
+	// action of a bandit whose policy() is Policy, without heap allocation
+	template<int Policy>
 	int action()
 	{
 		uniform_int_distribution<int> unifn_dist(0, k_ - 1);
 		uniform_real_distribution<double> unifr_dist(0, 1);
-		if (epsilon_>0 && unifr_dist(rnd_engine)<epsilon_) return unifn_dist(rnd_engine);
+		if (Policy != Greedy && epsilon_>0 && unifr_dist(rnd_engine)<epsilon_) return unifn_dist(rnd_engine);
 
-		if (ucb_param_ != NULL) {
-			auto ucb_est = q_est_;
-			for (int i = 0; i<k_; i++) ucb_est[i] += (*ucb_param_) * sqrt(log(time_step_ + 1) / (action_count_[i] + 1));
-			return distance(ucb_est.begin(), max_element(ucb_est.begin(), ucb_est.end()));
+		int best = 0;
+		if (Policy != Gradient && tracks_argmax()) {
+			double ucb_coef = Policy == Ucb ? (*ucb_param_) * sqrt(log(time_step_ + 1)) : 0;
+			return argmax_.argmax(ucb_coef, q_est_.data(), Policy == Ucb ? ucb_scale_.data() : NULL);
 		}
-
-		if (gradient_) {
-			auto exp_est = q_est_;
-			for (int i = 0; i<k_; i++) exp_est[i] = exp(q_est_[i]);
-			auto tot = accumulate(exp_est.begin(), exp_est.end(), 0.0);
-			action_prob_ = move(exp_est);
-			for (auto &x : action_prob_) x = x / tot;
-			discrete_distribution<int> disc_dist(action_prob_.begin(), action_prob_.end());
-			return disc_dist(rnd_engine);
+		if (Policy == Ucb) {
+			// the log term is shared by all actions, the count term only changes for the action taken
+			double ucb_coef = (*ucb_param_) * sqrt(log(time_step_ + 1));
+			double best_value = q_est_[0] + ucb_coef * ucb_scale_[0];
+			for (int i = 1; i<k_; i++) {
+				double value = q_est_[i] + ucb_coef * ucb_scale_[i];
+				if (value > best_value) { best_value = value; best = i; }
+			}
+			return best;
+		}
+		if (Policy == Gradient) {
+			// softmax in place, then sampled by inverse CDF
+			double tot = 0;
+			for (int i = 0; i<k_; i++) {
+				action_prob_[i] = exp(q_est_[i]);
+				tot += action_prob_[i];
+			}
+			for (int i = 0; i<k_; i++) action_prob_[i] /= tot;
+			double u = unifr_dist(rnd_engine), cdf = action_prob_[0];
+			while (best<k_ - 1 && cdf <= u) cdf += action_prob_[++best];
+			return best;
 		}
-		return distance(q_est_.begin(), max_element(q_est_.begin(), q_est_.end()));
+		for (int i = 1; i<k_; i++)
+			if (q_est_[i] > q_est_[best]) best = i;
+		return best;
 	}
 
 	double sample(int action_index)
@@ -94,22 +292,29 @@ public:
 		time_step_++;
 		average_reward_ = (time_step_ - 1.0) / time_step_ * average_reward_ + reward / time_step_;
 		action_count_[action_index] += 1;
+		ucb_scale_[action_index] = 1 / sqrt(action_count_[action_index] + 1.0);
 
 		if (sample_averages_) {
 			q_est_[action_index] += 1.0 / action_count_[action_index] * (reward - q_est_[action_index]);
 		}
 		else if (gradient_) {
-			vector<int> is_action(k_, 0);
-			is_action[action_index] = 1;
 			auto baseline = gradient_baseline_ ? average_reward_ : 0;
-			for (int i = 0; i<k_; i++) q_est_[i] += step_size_ * (reward - baseline) * (is_action[i] - action_prob_[i]);
+			for (int i = 0; i<k_; i++) q_est_[i] += step_size_ * (reward - baseline) * ((i == action_index) - action_prob_[i]);
 		}
 		else {
 			// constant step size
 			q_est_[action_index] += step_size_ * (reward - q_est_[action_index]);
 		}
+		if (tracks_argmax()) argmax_.update(action_index, q_est_.data(), ucb_param_ ? ucb_scale_.data() : NULL);
 		return reward;
 	}
+	// moves every true value one step of the random walk, after the reward of the step was drawn
+	void walk()
+	{
+		normal_distribution<double> norm_dist(0, 1);
+		for (int i = 0; i<k_; i++) q_true_[i] += random_walk_ * norm_dist(rnd_engine);
+		best_action_ = distance(q_true_.begin(), max_element(q_true_.begin(), q_true_.end()));
+	}
 };
 
 void figure2_1()
@@ -118,159 +323,886 @@ void figure2_1()
 	//normal_distribution<double> norm_dist_main(200,10), norm_dist_extra(0,10);
 }
 
-pair<vector<vector<double>>, vector<vector<double>> > bandit_simulation(int num_bandits, int time_step, vector<vector<Bandit*>>& bandits)
+// Standard normals for many independent streams at once, one stream per lane. Every lane runs its own
+// xorshift128+ generator and the lanes advance together in loops without branches or calls into <random>,
+// so generating the uniforms vectorizes. Box-Muller turns each pair of uniforms into two normals, and the
+// second one is handed out by the next call. Built with -O3 -ffast-math, g++ also vectorizes log/sin/cos.
+class GaussianBlock
 {
-	vector<vector<double>> best_action_counts(bandits.size(), vector<double>(time_step, 0.0));
-	vector<vector<double>> average_rewards(bandits.size(), vector<double>(time_step, 0.0));
-	for (size_t k = 0; k<bandits.size(); k++) {
-		for (int i = 0; i<num_bandits; i++) {
-			for (int t = 0; t<time_step; t++) {
-				auto action_index = bandits[k][i]->action();
-				auto reward = bandits[k][i]->sample(action_index);
-				average_rewards[k][t] += reward;
-				if (action_index == bandits[k][i]->best_action_) best_action_counts[k][t] += 1;
+private:
+	int lanes_;
+	vector<uint64_t> s0_, s1_;
+	vector<double> u1_, u2_, spare_;
+	bool has_spare_ = false;
+	// next uniform in [0, 1) of every lane, from the top 52 bits of xorshift128+ put into a double's mantissa
+	void uniforms(double* out) {
+		uint64_t* s0 = s0_.data();
+		uint64_t* s1 = s1_.data();
+		for (int l = 0; l<lanes_; l++) {
+			uint64_t x = s0[l], y = s1[l];
+			s0[l] = y;
+			x ^= x << 23;
+			s1[l] = x ^ y ^ (x >> 17) ^ (y >> 26);
+			uint64_t bits = 0x3FF0000000000000ull | ((s1[l] + y) >> 12);
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			out[l] = d - 1.0;
+		}
+	}
+public:
+	GaussianBlock(int lanes = 0) : lanes_(lanes), s0_(lanes, 1), s1_(lanes, 2), u1_(lanes), u2_(lanes), spare_(lanes) {}
+	inline int lanes() const { return lanes_; }
+	// restarts lane on a stream seeded by seq
+	void seed(int lane, seed_seq& seq) {
+		uint32_t w[4];
+		seq.generate(w, w + 4);
+		s0_[lane] = uint64_t(w[0]) << 32 | w[1];
+		s1_[lane] = uint64_t(w[2]) << 32 | w[3];
+		if (s0_[lane] == 0 && s1_[lane] == 0) s1_[lane] = 1; // the all-zero state never leaves zero
+		has_spare_ = false;
+	}
+	// one standard normal of every lane into out[0, lanes)
+	void next(double* out) {
+		if (has_spare_) {
+			copy(spare_.begin(), spare_.end(), out);
+			has_spare_ = false;
+			return;
+		}
+		uniforms(u1_.data());
+		uniforms(u2_.data());
+		const double two_pi = 6.283185307179586;
+		for (int l = 0; l<lanes_; l++) {
+			double r = sqrt(-2.0 * log(1.0 - u1_[l])); // 1 - u in (0, 1]
+			out[l] = r * cos(two_pi * u2_[l]);
+			spare_[l] = r * sin(two_pi * u2_[l]);
+		}
+		has_spare_ = true;
+	}
+};
+
+bool scalar_normals = false; // draw every normal from its run's normal_distribution instead of a GaussianBlock
+
+// All runs of one bandit configuration stepped in lockstep. Per-arm data is stored arm-major,
+// [arm * runs + run], so the greedy argmax, the UCB bonus, the softmax and the gradient update are
+// loops over contiguous runs the compiler vectorizes. Every run keeps its own generator and draws
+// from it in the same order as a Bandit does; with scalar_normals each run then plays exactly like the
+// Bandit it replaces. By default the true values and the rewards come from a GaussianBlock instead,
+// one lane per run, so that the runs draw their normals together.
+class BatchedBandits
+{
+private:
+	int runs_, k_;
+	double epsilon_, step_size_, random_walk_;
+	bool sample_averages_, gradient_, gradient_baseline_;
+	double* ucb_param_;
+	int time_step_ = 0;
+	vector<default_random_engine> rnd_engines_;
+	GaussianBlock gaussians_;
+	vector<double> q_true_;      //[arm * runs + run]
+	vector<double> q_est_;       //[arm * runs + run]
+	vector<int> action_count_;   //[arm * runs + run]
+	vector<double> action_prob_; //[arm * runs + run]
+	vector<double> ucb_scale_;   //[arm * runs + run, 1 / sqrt(action count + 1)]
+	vector<double> average_reward_, rewards_, best_values_, prob_total_, steps_;
+	vector<int> best_action_, actions_, greedy_;
+	vector<char> explored_;
+	inline double& at(vector<double>& v, int arm, int run) { return v[size_t(arm) * runs_ + run]; }
+public:
+	// runs [first_run, first_run + runs) of configuration k, seeded like Bandit::seed with (seed, k, run)
+	BatchedBandits(const Bandit& prototype, unsigned seed, int k, int first_run, int runs)
+		: runs_(runs), k_(prototype.k_), epsilon_(prototype.epsilon_), step_size_(prototype.step_size_), random_walk_(prototype.random_walk_),
+		sample_averages_(prototype.sample_averages_), gradient_(prototype.gradient_),
+		gradient_baseline_(prototype.gradient_baseline_), ucb_param_(prototype.ucb_param_)
+	{
+		size_t n = size_t(k_) * runs_;
+		q_true_.resize(n);
+		q_est_.resize(n);
+		action_count_.resize(n);
+		action_prob_.resize(n);
+		ucb_scale_.assign(n, 1.0);
+		rnd_engines_.resize(runs_);
+		best_action_.resize(runs_);
+		if (!scalar_normals) gaussians_ = GaussianBlock(runs_);
+		for (int r = 0; r<runs_; r++) {
+			seed_seq run_seed{ seed, unsigned(k), unsigned(first_run + r) };
+			rnd_engines_[r].seed(run_seed);
+			if (scalar_normals) {
+				normal_distribution<double> norm_dist(0, 1);
+				for (int i = 0; i<k_; i++) at(q_true_, i, r) = random_walk_ > 0 ? 0 : norm_dist(rnd_engines_[r]);
+			}
+			else {
+				seed_seq lane_seed{ seed, unsigned(k), unsigned(first_run + r), 1u };
+				gaussians_.seed(r, lane_seed);
+			}
+		}
+		if (random_walk_ > 0) fill(q_true_.begin(), q_true_.end(), 0.0);
+		else if (!scalar_normals)
+			for (int i = 0; i<k_; i++) gaussians_.next(&q_true_[size_t(i) * runs_]);
+		for (int r = 0; r<runs_; r++) {
+			for (int i = 0; i<k_; i++) {
+				at(q_true_, i, r) += prototype.true_reward_;
+				at(q_est_, i, r) = prototype.q_est_[i];
+				action_count_[size_t(i) * runs_ + r] = 0;
+			}
+			best_action_[r] = 0;
+			for (int i = 1; i<k_; i++)
+				if (at(q_true_, i, r) > at(q_true_, best_action_[r], r)) best_action_[r] = i;
+		}
+		average_reward_.assign(runs_, 0);
+		rewards_.resize(runs_);
+		best_values_.resize(runs_);
+		prob_total_.resize(runs_);
+		actions_.resize(runs_);
+		greedy_.resize(runs_);
+		explored_.resize(runs_);
+		steps_.resize(runs_);
+	}
+	inline int runs() const { return runs_; }
+	inline const vector<int>& actions() const { return actions_; }
+	inline const vector<double>& rewards() const { return rewards_; }
+	inline const vector<int>& best_actions() const { return best_action_; }
+	// picks actions_ for every run of a configuration whose policy() is Policy
+	template<int Policy>
+	void action()
+	{
+		uniform_int_distribution<int> unifn_dist(0, k_ - 1);
+		uniform_real_distribution<double> unifr_dist(0, 1);
+		if (Policy != Greedy) {
+			for (int r = 0; r<runs_; r++) {
+				explored_[r] = epsilon_>0 && unifr_dist(rnd_engines_[r])<epsilon_;
+				if (explored_[r]) actions_[r] = unifn_dist(rnd_engines_[r]);
+			}
+		}
+
+		if (Policy == Gradient) {
+			double* prob = action_prob_.data();
+			const double* est = q_est_.data();
+			double* tot = prob_total_.data();
+			fill(tot, tot + runs_, 0.0);
+			for (int i = 0; i<k_; i++)
+				for (int r = 0; r<runs_; r++) {
+					prob[i * runs_ + r] = exp(est[i * runs_ + r]);
+					tot[r] += prob[i * runs_ + r];
+				}
+			for (int i = 0; i<k_; i++)
+				for (int r = 0; r<runs_; r++) prob[i * runs_ + r] /= tot[r];
+			for (int r = 0; r<runs_; r++) {
+				if (Policy != Greedy && explored_[r]) continue;
+				double u = unifr_dist(rnd_engines_[r]);
+				int a = 0;
+				double cdf = prob[r];
+				while (a<k_ - 1 && cdf <= u) cdf += prob[++a * runs_ + r];
+				actions_[r] = a;
+			}
+			return;
+		}
+
+		// argmax over arms as a branch-free select per run, the first maximum wins like max_element
+		double* best = best_values_.data();
+		int* best_arm = greedy_.data();
+		const double* est = q_est_.data();
+		const double* scale = ucb_scale_.data();
+		// the log term is shared by all runs and arms, the count term only changes for the arm taken
+		double ucb_coef = Policy == Ucb ? (*ucb_param_) * sqrt(log(time_step_ + 1.0)) : 0;
+		for (int i = 0; i<k_; i++) {
+			for (int r = 0; r<runs_; r++) {
+				double v = est[i * runs_ + r];
+				if (Policy == Ucb) v += ucb_coef * scale[i * runs_ + r];
+				bool better = i == 0 || v > best[r];
+				best[r] = better ? v : best[r];
+				best_arm[r] = better ? i : best_arm[r];
+			}
+		}
+		for (int r = 0; r<runs_; r++)
+			if (Policy == Greedy || !explored_[r]) actions_[r] = best_arm[r];
+	}
+	// draws the rewards_ of actions_ and learns from them
+	void sample()
+	{
+		time_step_++;
+		if (scalar_normals) {
+			for (int r = 0; r<runs_; r++) {
+				normal_distribution<double> norm_dist(0, 1);
+				rewards_[r] = norm_dist(rnd_engines_[r]);
+			}
+		}
+		else {
+			gaussians_.next(rewards_.data());
+		}
+		for (int r = 0; r<runs_; r++) rewards_[r] += at(q_true_, actions_[r], r);
+		double t = time_step_;
+		for (int r = 0; r<runs_; r++)
+			average_reward_[r] = (t - 1.0) / t * average_reward_[r] + rewards_[r] / t;
+		for (int r = 0; r<runs_; r++) {
+			size_t j = size_t(actions_[r]) * runs_ + r;
+			action_count_[j] += 1;
+			ucb_scale_[j] = 1 / sqrt(action_count_[j] + 1.0);
+		}
+
+		if (sample_averages_) {
+			for (int r = 0; r<runs_; r++) {
+				size_t j = size_t(actions_[r]) * runs_ + r;
+				q_est_[j] += 1.0 / action_count_[j] * (rewards_[r] - q_est_[j]);
+			}
+		}
+		else if (gradient_) {
+			double* est = q_est_.data();
+			const double* prob = action_prob_.data();
+			for (int i = 0; i<k_; i++)
+				for (int r = 0; r<runs_; r++) {
+					double baseline = gradient_baseline_ ? average_reward_[r] : 0;
+					est[i * runs_ + r] += step_size_ * (rewards_[r] - baseline) * ((actions_[r] == i) - prob[i * runs_ + r]);
+				}
+		}
+		else {
+			// constant step size
+			for (int r = 0; r<runs_; r++) {
+				size_t j = size_t(actions_[r]) * runs_ + r;
+				q_est_[j] += step_size_ * (rewards_[r] - q_est_[j]);
 			}
 		}
-		for (auto &x : best_action_counts[k]) x = x / num_bandits;
-		for (auto &x : average_rewards[k]) x = x / num_bandits;
 	}
-	return make_pair(best_action_counts, average_rewards);
+	// moves the true values of every run one step of the random walk, a row of normals per arm across the
+	// runs, and finds the new best actions by the same branch-free select as the greedy argmax
+	void walk()
+	{
+		if (scalar_normals) {
+			for (int r = 0; r<runs_; r++) {
+				normal_distribution<double> norm_dist(0, 1);
+				for (int i = 0; i<k_; i++) at(q_true_, i, r) += random_walk_ * norm_dist(rnd_engines_[r]);
+			}
+		}
+		else {
+			for (int i = 0; i<k_; i++) {
+				double* q = &q_true_[size_t(i) * runs_];
+				gaussians_.next(steps_.data());
+				for (int r = 0; r<runs_; r++) q[r] += random_walk_ * steps_[r];
+			}
+		}
+		double* best = best_values_.data();
+		int* best_arm = best_action_.data();
+		const double* q = q_true_.data();
+		for (int i = 0; i<k_; i++) {
+			for (int r = 0; r<runs_; r++) {
+				double v = q[i * runs_ + r];
+				bool better = i == 0 || v > best[r];
+				best[r] = better ? v : best[r];
+				best_arm[r] = better ? i : best_arm[r];
+			}
+		}
+	}
+};
+
+// Mean and variance over runs of the reward and of taking the optimal action at every time step of one
+// configuration, kept by Welford updates, so memory does not grow with the number of runs. With a stride
+// the curve is decimated: point p is the run's mean over time steps [p * stride, (p + 1) * stride), so
+// memory does not grow with the horizon either.
+struct CurveStats {
+	long long runs = 0;
+	int steps = 0, stride = 1;
+	vector<double> reward_mean, reward_m2, optimal_mean, optimal_m2; //[point]
+	double average_mean = 0, average_m2 = 0; // of the reward averaged over all time steps of a run
+	CurveStats(int time_step = 0, int stride = 1) : steps(time_step), stride(stride) {
+		int n = (time_step + stride - 1) / stride;
+		reward_mean.assign(n, 0.0);
+		reward_m2.assign(n, 0.0);
+		optimal_mean.assign(n, 0.0);
+		optimal_m2.assign(n, 0.0);
+	}
+	inline int time_step() const { return steps; }
+	inline int points() const { return (int)reward_mean.size(); }
+	// whether time step t is the last of its point, and how many time steps that point has up to t
+	inline bool closes_point(int t) const { return (t + 1) % stride == 0 || t + 1 == steps; }
+	inline int point_length(int t) const { return t % stride + 1; }
+	// adds run number n (counted from 1) at point t, every run has to be added at every point
+	inline void add(int t, long long n, double reward, double optimal) {
+		double d = reward - reward_mean[t];
+		reward_mean[t] += d / n;
+		reward_m2[t] += d * (reward - reward_mean[t]);
+		d = optimal - optimal_mean[t];
+		optimal_mean[t] += d / n;
+		optimal_m2[t] += d * (optimal - optimal_mean[t]);
+	}
+	// adds the reward of run number n averaged over its time steps
+	inline void add_average(long long n, double average) {
+		double d = average - average_mean;
+		average_mean += d / n;
+		average_m2 += d * (average - average_mean);
+	}
+	// adds the stats of other runs (Chan et al.'s pairwise update)
+	void merge(const CurveStats& other) {
+		long long n = runs + other.runs;
+		if (other.runs == 0) return;
+		double d = other.average_mean - average_mean;
+		average_mean += d * other.runs / n;
+		average_m2 += other.average_m2 + d * d * runs * other.runs / n;
+		for (int t = 0; t<points(); t++) {
+			double d = other.reward_mean[t] - reward_mean[t];
+			reward_mean[t] += d * other.runs / n;
+			reward_m2[t] += other.reward_m2[t] + d * d * runs * other.runs / n;
+			d = other.optimal_mean[t] - optimal_mean[t];
+			optimal_mean[t] += d * other.runs / n;
+			optimal_m2[t] += other.optimal_m2[t] + d * d * runs * other.runs / n;
+		}
+		runs = n;
+	}
+	inline double variance(const vector<double>& m2, int t) const { return runs > 1 ? m2[t] / (runs - 1) : 0; }
+	// half width of the normal 95% confidence interval of a mean
+	inline double ci95(const vector<double>& m2, int t) const { return runs > 1 ? 1.96 * sqrt(variance(m2, t) / runs) : 0; }
+	inline double average_ci95() const { return runs > 1 ? 1.96 * sqrt(average_m2 / (runs - 1) / runs) : 0; }
+};
+
+// Curves of all figures into one file as soon as each configuration is done. The CSV has a row per
+// (figure, configuration, point), t being the first time step of the point. The binary file starts with
+// the 8 bytes "BANDITS2", then every configuration is a header of a 32-byte figure name, uint32
+// configuration, uint32 points, uint32 stride, uint32 zero and uint64 runs, followed per point by four
+// float32: reward mean and variance, optimal action mean and variance.
+class CurveWriter
+{
+private:
+	ofstream out_;
+	bool binary_ = false;
+public:
+	bool open(const string& path, bool binary) {
+		binary_ = binary;
+		out_.open(path, binary ? ios::binary : ios::out);
+		if (!out_) {
+			cout << "Cannot write " << path << endl;
+			return false;
+		}
+		if (binary_) out_.write("BANDITS2", 8);
+		else out_ << "figure,config,t,runs,reward_mean,reward_var,reward_ci95,optimal_mean,optimal_var,optimal_ci95" << endl;
+		return true;
+	}
+	void write(const string& figure, int config, const CurveStats& stats) {
+		if (!out_.is_open()) return;
+		if (binary_) {
+			char name[32] = {};
+			strncpy(name, figure.c_str(), sizeof(name) - 1);
+			uint32_t header[4] = { uint32_t(config), uint32_t(stats.points()), uint32_t(stats.stride), 0 };
+			uint64_t runs = stats.runs;
+			out_.write(name, sizeof(name));
+			out_.write((const char*)header, sizeof(header));
+			out_.write((const char*)&runs, sizeof(runs));
+			vector<float> rows(4 * size_t(stats.points()));
+			for (int t = 0; t<stats.points(); t++) {
+				rows[4 * t] = (float)stats.reward_mean[t];
+				rows[4 * t + 1] = (float)stats.variance(stats.reward_m2, t);
+				rows[4 * t + 2] = (float)stats.optimal_mean[t];
+				rows[4 * t + 3] = (float)stats.variance(stats.optimal_m2, t);
+			}
+			out_.write((const char*)rows.data(), rows.size() * sizeof(float));
+		}
+		else {
+			for (int t = 0; t<stats.points(); t++)
+				out_ << figure << ',' << config << ',' << (long long)t * stats.stride << ',' << stats.runs << ','
+				<< stats.reward_mean[t] << ',' << stats.variance(stats.reward_m2, t) << ',' << stats.ci95(stats.reward_m2, t) << ','
+				<< stats.optimal_mean[t] << ',' << stats.variance(stats.optimal_m2, t) << ',' << stats.ci95(stats.optimal_m2, t) << '\n';
+		}
+		out_.flush();
+	}
+};
+
+// Runs are simulated in blocks of a fixed number of runs, each block keeps its own stats, and the blocks
+// are merged in order. Together with the per-run seeds this makes the results independent of the number
+// of workers and of which worker got which block.
+const int BlockRuns = 256;
+
+// stats of runs [first, last) of configuration k, every run stepped as its own Bandit
+template<int Policy>
+void bandit_block(const Bandit& prototype, unsigned seed, int k, int first, int last, CurveStats& stats)
+{
+	for (int i = first; i<last; i++) {
+		Bandit bandit(prototype);
+		seed_seq run_seed{ seed, unsigned(k), unsigned(i) };
+		bandit.seed(run_seed);
+		double total = 0, window_reward = 0, window_optimal = 0;
+		for (int t = 0; t<stats.time_step(); t++) {
+			auto action_index = bandit.action<Policy>();
+			window_optimal += action_index == bandit.best_action_;
+			double reward = bandit.sample(action_index);
+			window_reward += reward;
+			total += reward;
+			if (bandit.random_walk_ > 0) bandit.walk();
+			if (stats.closes_point(t)) {
+				int n = stats.point_length(t);
+				stats.add(t / stats.stride, i - first + 1, window_reward / n, window_optimal / n);
+				window_reward = window_optimal = 0;
+			}
+		}
+		stats.add_average(i - first + 1, total / stats.time_step());
+	}
+	stats.runs = last - first;
+}
+
+// same stats as bandit_block, all runs of the block stepped in lockstep by BatchedBandits
+template<int Policy>
+void batched_bandit_block(const Bandit& prototype, unsigned seed, int k, int first, int last, CurveStats& stats)
+{
+	BatchedBandits bandits(prototype, seed, k, first, last - first);
+	vector<double> totals(bandits.runs(), 0.0), window_rewards(bandits.runs(), 0.0), window_optimals(bandits.runs(), 0.0);
+	for (int t = 0; t<stats.time_step(); t++) {
+		bandits.action<Policy>();
+		for (int i = 0; i<bandits.runs(); i++) window_optimals[i] += bandits.actions()[i] == bandits.best_actions()[i];
+		bandits.sample();
+		for (int i = 0; i<bandits.runs(); i++) {
+			window_rewards[i] += bandits.rewards()[i];
+			totals[i] += bandits.rewards()[i];
+		}
+		if (prototype.random_walk_ > 0) bandits.walk();
+		if (stats.closes_point(t)) {
+			int n = stats.point_length(t);
+			for (int i = 0; i<bandits.runs(); i++) {
+				stats.add(t / stats.stride, i + 1, window_rewards[i] / n, window_optimals[i] / n);
+				window_rewards[i] = window_optimals[i] = 0;
+			}
+		}
+	}
+	for (int i = 0; i<bandits.runs(); i++) stats.add_average(i + 1, totals[i] / stats.time_step());
+	stats.runs = last - first;
+}
+
+bool scalar_engine = false; // step every run as its own Bandit instead of batched
+int num_workers = 0;        // 0 for all cores
+unsigned global_seed = 0;
+CurveWriter curve_writer;   // not open unless asked for
+int curve_stride = 0;       // time steps per point of a curve, 0 for at most about 1000 points
+
+inline int stride_for(int time_step) { return curve_stride > 0 ? curve_stride : max(1, time_step / 1000); }
+
+// block of runs on the engine selected, with the kernels of the prototype's policy. A bandit with an
+// ArgmaxTree always runs on its own, the batched engine would scan all arms of every run each step.
+void simulate_block(const Bandit& prototype, unsigned seed, int k, int first, int last, CurveStats& stats)
+{
+	bool scalar_engine = ::scalar_engine || prototype.tracks_argmax();
+	switch (prototype.policy()) {
+	case Greedy:
+		if (scalar_engine) bandit_block<Greedy>(prototype, seed, k, first, last, stats);
+		else batched_bandit_block<Greedy>(prototype, seed, k, first, last, stats);
+		break;
+	case EpsilonGreedy:
+		if (scalar_engine) bandit_block<EpsilonGreedy>(prototype, seed, k, first, last, stats);
+		else batched_bandit_block<EpsilonGreedy>(prototype, seed, k, first, last, stats);
+		break;
+	case Ucb:
+		if (scalar_engine) bandit_block<Ucb>(prototype, seed, k, first, last, stats);
+		else batched_bandit_block<Ucb>(prototype, seed, k, first, last, stats);
+		break;
+	case Gradient:
+		if (scalar_engine) bandit_block<Gradient>(prototype, seed, k, first, last, stats);
+		else batched_bandit_block<Gradient>(prototype, seed, k, first, last, stats);
+		break;
+	}
+}
+
+// Run fn(i) for every i in [0, n) on num_workers threads, each taking the next i once it is free
+template<class Fn>
+void parallel_for_each(int n, int num_workers, Fn fn)
+{
+	if (num_workers <= 0) num_workers = max(1u, thread::hardware_concurrency());
+	num_workers = max(1, min(num_workers, n));
+	atomic<int> next(0);
+	auto work = [&]() {
+		for (int i = next++; i<n; i = next++) fn(i);
+	};
+	vector<thread> threads;
+	for (int w = 1; w<num_workers; w++) threads.emplace_back(work);
+	work();
+	for (auto &t : threads) t.join();
+}
+
+// Runs simulate(i, stats) for every block i in [0, n) on the workers, each into its own stats, and hands
+// the stats to merge(i, stats) in the order of i. A finished block waits only until the blocks before it
+// are merged, so few blocks are held at a time.
+template<class Simulate, class Merge>
+void simulate_in_order(int n, int time_step, Simulate simulate, Merge merge)
+{
+	map<int, CurveStats> finished;
+	int next_merge = 0;
+	mutex merge_mutex;
+	parallel_for_each(n, num_workers, [&](int i) {
+		CurveStats stats(time_step, stride_for(time_step));
+		simulate(i, stats);
+		lock_guard<mutex> lock(merge_mutex);
+		finished[i] = move(stats);
+		for (auto it = finished.begin(); it != finished.end() && it->first == next_merge; it = finished.erase(it), next_merge++)
+			merge(it->first, it->second);
+	});
+}
+
+// Stats of num_bandits runs of configuration k, run i drawing from a generator seeded by (seed, k, i)
+CurveStats bandit_simulation(int num_bandits, int time_step, const Bandit& prototype, int k, unsigned seed)
+{
+	int num_blocks = (num_bandits + BlockRuns - 1) / BlockRuns;
+	CurveStats total(time_step, stride_for(time_step));
+	simulate_in_order(num_blocks, time_step, [&](int b, CurveStats& stats) {
+		simulate_block(prototype, seed, k, b * BlockRuns, min(num_bandits, (b + 1) * BlockRuns), stats);
+	}, [&](int, const CurveStats& stats) {
+		total.merge(stats);
+	});
+	return total;
+}
+
+// simulates num_bandits runs of every prototype, writes their curves and prints how the last time step ended
+void simulate(const string& name, int num_bandits, int time_step, const vector<Bandit>& prototypes)
+{
+	auto start = chrono::steady_clock::now();
+	vector<pair<double, double>> last_step;
+	for (size_t k = 0; k<prototypes.size(); k++) {
+		CurveStats stats = bandit_simulation(num_bandits, time_step, prototypes[k], (int)k, global_seed);
+		curve_writer.write(name, (int)k, stats);
+		int t = stats.points() - 1;
+		last_step.push_back(make_pair(stats.optimal_mean[t], stats.reward_mean[t]));
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << name << " : " << seconds << " s" << endl;
+	for (size_t k = 0; k<prototypes.size(); k++)
+		cout << "  " << k << ": optimal action " << last_step[k].first << ", average reward " << last_step[k].second << endl;
 }
 
 // figure 2.2
 void epsilon_greedy(int num_bandits, int time_step)
 {
 	vector<double> epsilons = { 0, 0.1, 0.01 };
-	vector<vector<Bandit*>> bandits;
+	vector<Bandit> prototypes;
 	for (size_t i = 0; i<epsilons.size(); i++) {
-		vector<Bandit*> vec_bandits;
-		for (int j = 0; j<num_bandits; j++) {
-			vec_bandits.push_back(new Bandit());
-			vec_bandits.back()->epsilon_ = epsilons[i];
-			vec_bandits.back()->sample_averages_ = true;
-		}
-		bandits.push_back(vec_bandits);
-	}
-	auto res = bandit_simulation(num_bandits, time_step, bandits);
-	for (auto &v : bandits)
-		for (auto p : v)
-			delete p;
+		prototypes.push_back(Bandit());
+		prototypes.back().epsilon_ = epsilons[i];
+		prototypes.back().sample_averages_ = true;
+	}
+	simulate("epsilon greedy", num_bandits, time_step, prototypes);
 }
 
 // figure 2.3
 void optimistic_initial_values(int num_bandits, int time_step)
 {
-	vector<vector<Bandit*>> bandits;
-	vector<Bandit*> vec_bandits;
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0., 5, 0.1));
-	}
-	bandits.push_back(vec_bandits);
-	vec_bandits.clear();
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0.1, 0, 0.1));
-	}
-	bandits.push_back(vec_bandits);
-	auto res = bandit_simulation(num_bandits, time_step, bandits);
-	for (auto &v : bandits)
-		for (auto p : v)
-			delete p;
+	vector<Bandit> prototypes = { Bandit(10, 0., 5, 0.1), Bandit(10, 0.1, 0, 0.1) };
+	simulate("optimistic initial values", num_bandits, time_step, prototypes);
 }
 
 // figure 2.4
 void ucb(int num_bandits, int time_step)
 {
-	vector<vector<Bandit*>> bandits;
-	vector<Bandit*> vec_bandits;
 	double ucb_param = 2;
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0., 0., 0.1, false, &ucb_param));
-	}
-	bandits.push_back(vec_bandits);
-	vec_bandits.clear();
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0.1, 0., 0.1));
-	}
-	bandits.push_back(vec_bandits);
-	auto res = bandit_simulation(num_bandits, time_step, bandits);
-	for (auto &v : bandits)
-		for (auto p : v)
-			delete p;
+	vector<Bandit> prototypes = { Bandit(10, 0., 0., 0.1, false, &ucb_param), Bandit(10, 0.1, 0., 0.1) };
+	simulate("ucb", num_bandits, time_step, prototypes);
 }
 
 // for figure 2.5
 void gradient_bandit(int num_bandits, int time_step)
 {
-	vector<vector<Bandit*>> bandits;
-	vector<Bandit*> vec_bandits;
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0., 0., 0.1, false, NULL, true, true, 4));
+	vector<Bandit> prototypes = {
+		Bandit(10, 0., 0., 0.1, false, NULL, true, true, 4),
+		Bandit(10, 0., 0., 0.1, false, NULL, true, false, 4),
+		Bandit(10, 0., 0., 0.4, false, NULL, true, true, 4),
+		Bandit(10, 0., 0., 0.4, false, NULL, true, false, 4)
+	};
+	simulate("gradient bandit", num_bandits, time_step, prototypes);
+}
+
+// Counts a hardware event of the calling thread with perf_event_open; ok() is false where that is not
+// available, e.g. off Linux or when perf_event_paranoid forbids it.
+class PerfCounter
+{
+private:
+	int fd_ = -1;
+public:
+	PerfCounter(unsigned long long config)
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd_ = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
 	}
-	bandits.push_back(vec_bandits);
-	vec_bandits.clear();
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0., 0., 0.1, false, NULL, true, false, 4));
+	~PerfCounter()
+	{
+#ifdef __linux__
+		if (fd_ >= 0) close(fd_);
+#endif
 	}
-	bandits.push_back(vec_bandits);
-	vec_bandits.clear();
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0., 0., 0.4, false, NULL, true, true, 4));
+	PerfCounter(const PerfCounter&) = delete;
+	PerfCounter& operator=(const PerfCounter&) = delete;
+	inline bool ok() const { return fd_ >= 0; }
+	void start()
+	{
+#ifdef __linux__
+		if (!ok()) return;
+		ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+	// events since start()
+	long long stop()
+	{
+		long long count = 0;
+#ifdef __linux__
+		if (!ok()) return 0;
+		ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd_, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+		return count;
+	}
+};
+
+// Per-step cost of one policy at one number of arms, over repeated timings of the same steps
+struct StepBenchmark {
+	string policy;
+	int arms;
+	long long steps;
+	vector<double> ns_per_step;
+	double allocations_per_step, branches_per_step, branch_misses_per_step;
+	bool has_branches;
+	// p-th percentile of the timings, interpolated between neighbouring ranks
+	double percentile(double p) const {
+		vector<double> sorted = ns_per_step;
+		sort(sorted.begin(), sorted.end());
+		double rank = p / 100 * (sorted.size() - 1);
+		size_t lo = (size_t)rank, hi = min(lo + 1, sorted.size() - 1);
+		return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
 	}
-	bandits.push_back(vec_bandits);
-	vec_bandits.clear();
-	for (int j = 0; j<num_bandits; j++) {
-		vec_bandits.push_back(new Bandit(10, 0., 0., 0.4, false, NULL, true, false, 4));
+	// branch counters are null where perf events are not available
+	string json(bool argmax_tree) const {
+		ostringstream out;
+		out << "{\"policy\": \"" << policy << "\", \"arms\": " << arms << ", \"argmax\": \"" << (argmax_tree ? "tree" : "scan")
+			<< "\", \"steps\": " << steps << ", \"repeats\": " << ns_per_step.size()
+			<< ", \"median_ns_per_step\": " << percentile(50) << ", \"p10_ns_per_step\": " << percentile(10)
+			<< ", \"p90_ns_per_step\": " << percentile(90) << ", \"allocations_per_step\": " << allocations_per_step;
+		if (has_branches) out << ", \"branches_per_step\": " << branches_per_step << ", \"branch_misses_per_step\": " << branch_misses_per_step;
+		else out << ", \"branches_per_step\": null, \"branch_misses_per_step\": null";
+		out << "}";
+		return out.str();
 	}
-	bandits.push_back(vec_bandits);
-	auto res = bandit_simulation(num_bandits, time_step, bandits);
-	for (auto &v : bandits) {
-		for (auto p : v) {
-			delete p;
+};
+
+// Runs of time_step steps of a copy of prototype: once to warm up, then repeat times timed. Every timing
+// restarts the same runs, so the steps are the same each time; only the stepping is measured, the copies
+// and the seeding are not.
+template<int Policy>
+StepBenchmark benchmark_steps(const string& name, const Bandit& prototype, int runs, int time_step, int repeat, unsigned seed)
+{
+	StepBenchmark result;
+	result.policy = name;
+	result.arms = prototype.k_;
+	result.steps = (long long)runs * time_step;
+	vector<Bandit> bandits(runs, prototype);
+	PerfCounter branches(PERF_COUNT_HW_BRANCH_INSTRUCTIONS), misses(PERF_COUNT_HW_BRANCH_MISSES);
+	result.has_branches = branches.ok() && misses.ok();
+	long long allocations = 0, branch_count = 0, miss_count = 0;
+	for (int i = -1; i<repeat; i++) { // -1 is the warm-up
+		for (size_t r = 0; r<bandits.size(); r++) bandits[r] = prototype;
+		for (size_t r = 0; r<bandits.size(); r++) {
+			seed_seq run_seed{ seed, unsigned(r) };
+			bandits[r].seed(run_seed);
+		}
+		long long allocations_before = heap_allocations.load();
+		branches.start();
+		misses.start();
+		auto start = chrono::steady_clock::now();
+		for (auto &bandit : bandits)
+			for (int t = 0; t<time_step; t++) bandit.sample(bandit.action<Policy>());
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		long long miss_delta = misses.stop(), branch_delta = branches.stop();
+		if (i < 0) continue;
+		miss_count += miss_delta;
+		branch_count += branch_delta;
+		allocations += heap_allocations.load() - allocations_before;
+		result.ns_per_step.push_back(seconds * 1e9 / result.steps);
+	}
+	double total_steps = double(result.steps) * repeat;
+	result.allocations_per_step = allocations / total_steps;
+	result.branches_per_step = branch_count / total_steps;
+	result.branch_misses_per_step = miss_count / total_steps;
+	return result;
+}
+
+// JSON report of the step cost of every policy at 10, 100 and 1000 arms
+void benchmark(int runs, int time_step, int repeat, unsigned seed)
+{
+	double ucb_param = 2;
+	vector<pair<string, function<Bandit(int)>>> policies = {
+		{ "epsilon greedy", [](int k) {return Bandit(k, 0.1, 0., 0.1, true); } },
+		{ "optimistic greedy", [](int k) {return Bandit(k, 0., 5., 0.1); } },
+		{ "ucb", [&](int k) {return Bandit(k, 0., 0., 0.1, true, &ucb_param); } },
+		{ "gradient baseline", [](int k) {return Bandit(k, 0., 0., 0.1, false, NULL, true, true, 4); } },
+		{ "gradient", [](int k) {return Bandit(k, 0., 0., 0.1, false, NULL, true, false, 4); } }
+	};
+	vector<string> lines;
+	for (auto &policy : policies) {
+		for (int k : { 10, 100, 1000 }) {
+			Bandit prototype = policy.second(k);
+			StepBenchmark result;
+			switch (prototype.policy()) {
+			case Greedy: result = benchmark_steps<Greedy>(policy.first, prototype, runs, time_step, repeat, seed); break;
+			case EpsilonGreedy: result = benchmark_steps<EpsilonGreedy>(policy.first, prototype, runs, time_step, repeat, seed); break;
+			case Ucb: result = benchmark_steps<Ucb>(policy.first, prototype, runs, time_step, repeat, seed); break;
+			case Gradient: result = benchmark_steps<Gradient>(policy.first, prototype, runs, time_step, repeat, seed); break;
+			}
+			lines.push_back(result.json(prototype.tracks_argmax()));
 		}
 	}
+	cout << "{\"runs\": " << runs << ", \"steps_per_run\": " << time_step << ", \"seed\": " << seed << ", \"benchmarks\": [" << endl;
+	for (size_t i = 0; i<lines.size(); i++) cout << "  " << lines[i] << (i + 1<lines.size() ? "," : "") << endl;
+	cout << "]}" << endl;
+}
 
+// exercise 2.5: true values that all start at 0 and take independent random walks, sample averages
+// against a constant step size, both epsilon greedy
+void nonstationary(int num_bandits, int time_step)
+{
+	vector<Bandit> prototypes = { Bandit(10, 0.1, 0., 0.1, true), Bandit(10, 0.1, 0., 0.1, false) };
+	for (auto &prototype : prototypes) prototype.random_walk_ = 0.01;
+	simulate("nonstationary", num_bandits, time_step, prototypes);
 }
 
-// figure 2.6
-void figure2_6(int num_bandits, int time_step)
+// testbed with many arms, where greedy and UCB selection go through ArgmaxTree
+void many_arms(int num_bandits, int time_step, int arms)
 {
-	vector<function<Bandit*(double*)>> generators = {
-		[](double* epsilon) {return new Bandit(10, *epsilon, 0., 0.1, true, NULL, false, false, 0); },
-		[](double* alpha) {return new Bandit(10, 0.0, 0., *alpha, true, NULL, true, true, 0); },
-		[](double* coef) {return new Bandit(10, 0.0, 0., 0.1, false, coef, false, false, 0); },
-		[](double* initial) {return new Bandit(10, 0.0, *initial, 0.1, false, NULL, false, false, 0); }
+	double ucb_param = 2;
+	vector<Bandit> prototypes = {
+		Bandit(arms, 0., 5, 0.1),
+		Bandit(arms, 0.1, 0., 0.1, true),
+		Bandit(arms, 0., 0., 0.1, true, &ucb_param)
 	};
-	vector<vector<double>> parameters(4);
-	for (int i = -7; i<-1; i++) parameters[0].push_back(i);
-	for (int i = -5; i< 2; i++) parameters[1].push_back(i);
-	for (int i = -4; i< 3; i++) parameters[2].push_back(i);
-	for (int i = -2; i< 3; i++) parameters[3].push_back(i);
-
-	vector<vector<Bandit*>> bandits;
-	// construct bandits
-	for (int i = 0; i<4; i++) {
-		for (auto &x : parameters[i]) {
-			vector<Bandit*> vec_bandits;
-			for (int j = 0; j<num_bandits; j++) {
-				vec_bandits.push_back(generators[i](&x));
+	simulate(to_string(arms) + " armed testbed", num_bandits, time_step, prototypes);
+}
+
+// A family of a parameter study: generator turns each value of grid into a bandit configuration
+struct SweepFamily {
+	string name;
+	function<Bandit(double*)> generator;
+	vector<double> grid;
+};
+
+// one grid point of a sweep and the stats of the runs it took
+struct SweepPoint {
+	int family;
+	double* parameter;
+	int scheduled;
+	CurveStats stats;
+};
+
+// Sweep scheduler: all grid points run together in waves of blocks of runs spread over the workers, and a
+// point stays in the waves until the 95% confidence interval of its average reward per run is within
+// tolerance, or it has max_runs runs. Each wave schedules the runs the current variance estimate says are
+// still needed. Bandits are only created inside the blocks by the generators, and stopping is decided
+// between waves on stats merged in order, so the runs and the results do not depend on the workers.
+vector<SweepPoint> sweep(vector<SweepFamily>& families, int time_step, int min_runs, int max_runs, double tolerance, unsigned seed)
+{
+	vector<SweepPoint> points;
+	for (size_t f = 0; f<families.size(); f++)
+		for (auto &x : families[f].grid) points.push_back({ (int)f, &x, 0, CurveStats(time_step, stride_for(time_step)) });
+	struct Unit { int point, first, last; };
+	while (true) {
+		vector<Unit> units;
+		for (size_t p = 0; p<points.size(); p++) {
+			auto &point = points[p];
+			const auto &stats = point.stats;
+			// a tolerance of 0 or less runs every point to max_runs
+			if (stats.runs >= max_runs || (tolerance > 0 && stats.runs >= min_runs && stats.average_ci95() <= tolerance)) continue;
+			double needed = tolerance > 0 ? min_runs : max_runs;
+			if (tolerance > 0 && stats.runs > 1) {
+				double sd = sqrt(stats.average_m2 / (stats.runs - 1));
+				needed = max(1.96 * 1.96 * sd * sd / (tolerance * tolerance), double(stats.runs + BlockRuns));
 			}
-			bandits.push_back(vec_bandits);
+			// clamped before it becomes an integer, a tiny tolerance asks for more runs than any int holds
+			needed = min(needed, double(max_runs));
+			int target = (int)min<double>(max_runs, ceil(needed / BlockRuns) * BlockRuns);
+			for (int first = point.scheduled; first<target; first += BlockRuns)
+				units.push_back({ (int)p, first, min(target, first + BlockRuns) });
+			point.scheduled = target;
 		}
+		if (units.empty()) break;
+		simulate_in_order((int)units.size(), time_step, [&](int u, CurveStats& stats) {
+			const auto &point = points[units[u].point];
+			Bandit prototype = families[point.family].generator(point.parameter);
+			simulate_block(prototype, seed, units[u].point, units[u].first, units[u].last, stats);
+		}, [&](int u, const CurveStats& stats) {
+			points[units[u].point].stats.merge(stats);
+		});
+	}
+	return points;
+}
+
+// figure 2.6, each point with at most num_bandits runs, fewer once its average reward is known to within tolerance
+void figure2_6(int num_bandits, int time_step, double tolerance)
+{
+	vector<SweepFamily> families = {
+		{ "epsilon greedy epsilon", [](double* epsilon) {return Bandit(10, *epsilon, 0., 0.1, true, NULL, false, false, 0); }, {} },
+		{ "gradient bandit alpha", [](double* alpha) {return Bandit(10, 0.0, 0., *alpha, false, NULL, true, true, 0); }, {} },
+		{ "ucb c", [](double* coef) {return Bandit(10, 0.0, 0., 0.1, true, coef, false, false, 0); }, {} },
+		{ "optimistic initialization q0", [](double* initial) {return Bandit(10, 0.0, *initial, 0.1, false, NULL, false, false, 0); }, {} }
+	};
+	for (int i = -7; i<-1; i++) families[0].grid.push_back(pow(2, i));
+	for (int i = -5; i< 2; i++) families[1].grid.push_back(pow(2, i));
+	for (int i = -4; i< 3; i++) families[2].grid.push_back(pow(2, i));
+	for (int i = -2; i< 3; i++) families[3].grid.push_back(pow(2, i));
+
+	auto start = chrono::steady_clock::now();
+	auto points = sweep(families, time_step, min(num_bandits, 2 * BlockRuns), num_bandits, tolerance, global_seed);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	long long total_runs = 0;
+	for (auto &point : points) total_runs += point.stats.runs;
+	cout << "figure 2.6 : " << seconds << " s, " << total_runs << " runs instead of " << (long long)num_bandits * points.size() << endl;
+	for (size_t p = 0; p<points.size(); p++) {
+		const auto &point = points[p];
+		string name = families[point.family].name;
+		cout << "  " << name << " " << *point.parameter << ": average reward " << point.stats.average_mean
+			<< " +- " << point.stats.average_ci95() << " (" << point.stats.runs << " runs)" << endl;
+		curve_writer.write("figure 2.6 " + name + " " + to_string(*point.parameter), (int)p, point.stats);
 	}
-	auto res = bandit_simulation(num_bandits, time_step, bandits);
-	for (auto &v : bandits)
-		for (auto p : v)
-			delete p;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+	int num_bandits = 2000, time_step = 1000;
+	double tolerance = 0.05;
+	int arms = 0;
+	bool bench = false, walk = false;
+	int repeat = 5;
+	for (int i = 1; i<argc; i++) {
+		string arg = argv[i];
+		if (arg == "--scalar") scalar_engine = true;
+		else if (arg == "--scalar-normals") scalar_normals = true;
+		else if (arg == "--workers" && i + 1<argc) num_workers = atoi(argv[++i]);
+		else if (arg == "--seed" && i + 1<argc) global_seed = (unsigned)atoi(argv[++i]);
+		else if (arg == "--runs" && i + 1<argc) num_bandits = max(1, atoi(argv[++i]));
+		else if (arg == "--steps" && i + 1<argc) time_step = max(1, atoi(argv[++i]));
+		else if (arg == "--tolerance" && i + 1<argc) tolerance = atof(argv[++i]);
+		else if (arg == "--benchmark") bench = true;
+		else if (arg == "--nonstationary") walk = true;
+		else if (arg == "--stride" && i + 1<argc) curve_stride = max(1, atoi(argv[++i]));
+		else if (arg == "--repeat" && i + 1<argc) repeat = max(1, atoi(argv[++i]));
+		else if (arg == "--arms" && i + 1<argc) arms = max(2, atoi(argv[++i]));
+		else if (arg == "--csv" && i + 1<argc) { if (!curve_writer.open(argv[++i], false)) return 1; }
+		else if (arg == "--binary" && i + 1<argc) { if (!curve_writer.open(argv[++i], true)) return 1; }
+	}
+	if (bench) {
+		// a fixed 100 runs of --steps steps per policy and number of arms
+		count_allocations = true;
+		benchmark(100, time_step, repeat, global_seed);
+		return 0;
+	}
+	if (walk) {
+		nonstationary(num_bandits, time_step);
+		return 0;
+	}
+	if (arms > 0) {
+		many_arms(num_bandits, time_step, arms);
+		return 0;
+	}
 	figure2_1();
-	epsilon_greedy(2000, 1000);
-	optimistic_initial_values(2000, 1000);
-	ucb(2000, 1000);
-	gradient_bandit(2000, 1000);
+	epsilon_greedy(num_bandits, time_step);
+	optimistic_initial_values(num_bandits, time_step);
+	ucb(num_bandits, time_step);
+	gradient_bandit(num_bandits, time_step);
 
-	figure2_6(2000, 1000);
+	figure2_6(num_bandits, time_step, tolerance);
 	return 0;
 }
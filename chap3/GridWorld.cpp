@@ -21,127 +21,354 @@
 #include <iostream>
 #include <limits>
 #include <algorithm>
-#include <unordered_map>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <random>
+#include <chrono>
 using namespace std;
 
-const int WORLD_SIZE = 5;
-auto A_POS = make_pair(0, 1);
-auto A_PRIME_POS = make_pair(4, 1);
-auto B_POS = make_pair(0, 3);
-auto B_PRIME_POS = make_pair(2, 3);
 const double discount = 0.9;
 
-vector<vector<double>> world(WORLD_SIZE, vector<double>(WORLD_SIZE, 0));
+// A cell every action leaves for to, with reward; the book's A and B unless given on the command line
+struct SpecialCell {
+	pair<int, int> from, to;
+	double reward;
+};
 
-// left, up, right, down
-vector<char> actions = { 'L','U','R','D' };
-
-vector<vector<unordered_map<char, double>>> actionProb(WORLD_SIZE, vector<unordered_map<char, double>>(WORLD_SIZE, { { 'L',0.25 },{ 'U',0.25 },{ 'R',0.25 },{ 'D',0.25 } }));
+int world_size = 5;
+vector<SpecialCell> specials = { { make_pair(0, 1), make_pair(4, 1), 10.0 }, { make_pair(0, 3), make_pair(2, 3), 5.0 } };
 
-vector<vector<unordered_map<char, pair<int, int>>>> nextState(WORLD_SIZE, vector<unordered_map<char, pair<int, int>>>(WORLD_SIZE));
-vector<vector<unordered_map<char, double>>> actionReward(WORLD_SIZE, vector<unordered_map<char, double>>(WORLD_SIZE));
-
-void states_reward()
-{
-	for (int i = 0; i<WORLD_SIZE; i++) {
-		for (int j = 0; j<WORLD_SIZE; j++) {
-			unordered_map<char, pair<int, int>> next;
-			unordered_map<char, double> reward;
+// state of cell (i, j) is i * world_size + j
+int num_states = world_size * world_size;
+inline int state_index(pair<int, int> pos) { return pos.first * world_size + pos.second; }
 
-			next['U'] = i == 0 ? make_pair(i, j) : make_pair(i - 1, j);
-			reward['U'] = i == 0 ? -1.0 : 0.0;
+// left, up, right, down
+enum Action { LEFT, UP, RIGHT, DOWN, NUM_ACTIONS };
 
-			next['D'] = i == WORLD_SIZE - 1 ? make_pair(i, j) : make_pair(i + 1, j);
-			reward['D'] = i == WORLD_SIZE - 1 ? -1.0 : 0.0;
+// The MDP in flat arrays indexed by state * NUM_ACTIONS + action. Every move of the grid world is
+// deterministic, so a (state, action) pair has one successor state and one reward. Moving off the grid
+// or into an obstacle keeps the state and costs 1; obstacles themselves are never backed up.
+vector<double> actionProb;
+vector<int> nextState;
+vector<double> actionReward;
+vector<char> obstacle; //[state]
 
-			next['L'] = j == 0 ? make_pair(i, j) : make_pair(i, j - 1);
-			reward['L'] = j == 0 ? -1.0 : 0.0;
+// predecessors of state s are predecessor[predecessorBegin[s], predecessorBegin[s + 1]), for prioritized sweeping
+vector<int> predecessorBegin, predecessor;
 
-			next['R'] = j == WORLD_SIZE - 1 ? make_pair(i, j) : make_pair(i, j + 1);
-			reward['R'] = j == WORLD_SIZE - 1 ? -1.0 : 0.0;
+vector<double> world; //[state]
 
-			if (make_pair(i, j) == A_POS) {
-				next['L'] = next['R'] = next['D'] = next['U'] = A_PRIME_POS;
-				reward['L'] = reward['R'] = reward['D'] = reward['U'] = 10.0;
-			}
-			if (make_pair(i, j) == B_POS) {
-				next['L'] = next['R'] = next['D'] = next['U'] = B_PRIME_POS;
-				reward['L'] = reward['R'] = reward['D'] = reward['U'] = 5.0;
+void states_reward()
+{
+	num_states = world_size * world_size;
+	actionProb.assign(size_t(num_states) * NUM_ACTIONS, 1.0 / NUM_ACTIONS);
+	nextState.assign(size_t(num_states) * NUM_ACTIONS, 0);
+	actionReward.assign(size_t(num_states) * NUM_ACTIONS, 0.0);
+	obstacle.resize(num_states, 0);
+	// target of a move by (di, dj) from (i, j), or -1 when it is blocked
+	auto move_to = [](int i, int j, int di, int dj) {
+		i += di;
+		j += dj;
+		if (i < 0 || i >= world_size || j < 0 || j >= world_size || obstacle[state_index(make_pair(i, j))]) return -1;
+		return state_index(make_pair(i, j));
+	};
+	const int di[NUM_ACTIONS] = { 0, -1, 0, 1 }, dj[NUM_ACTIONS] = { -1, 0, 1, 0 };
+	for (int i = 0; i<world_size; i++) {
+		for (int j = 0; j<world_size; j++) {
+			int state = state_index(make_pair(i, j));
+			int* next = &nextState[size_t(state) * NUM_ACTIONS];
+			double* reward = &actionReward[size_t(state) * NUM_ACTIONS];
+			for (int a = 0; a<NUM_ACTIONS; a++) {
+				int target = obstacle[state] ? state : move_to(i, j, di[a], dj[a]);
+				next[a] = target < 0 ? state : target;
+				reward[a] = target < 0 ? -1.0 : 0.0;
 			}
-			nextState[i][j] = next;
-			actionReward[i][j] = reward;
 		}
 	}
+	for (auto &special : specials) {
+		int state = state_index(special.from);
+		fill(&nextState[size_t(state) * NUM_ACTIONS], &nextState[size_t(state + 1) * NUM_ACTIONS], state_index(special.to));
+		fill(&actionReward[size_t(state) * NUM_ACTIONS], &actionReward[size_t(state + 1) * NUM_ACTIONS], special.reward);
+	}
+
+	// counting sort of the (state, action) pairs by successor
+	predecessorBegin.assign(num_states + 1, 0);
+	for (int s = 0; s<num_states; s++)
+		if (!obstacle[s])
+			for (int a = 0; a<NUM_ACTIONS; a++) predecessorBegin[nextState[size_t(s) * NUM_ACTIONS + a] + 1]++;
+	for (int s = 0; s<num_states; s++) predecessorBegin[s + 1] += predecessorBegin[s];
+	predecessor.resize(predecessorBegin[num_states]);
+	vector<int> fill_pos(predecessorBegin.begin(), predecessorBegin.end() - 1);
+	for (int s = 0; s<num_states; s++)
+		if (!obstacle[s])
+			for (int a = 0; a<NUM_ACTIONS; a++) {
+				int next = nextState[size_t(s) * NUM_ACTIONS + a];
+				// a state reached by several actions is its predecessor once
+				if (fill_pos[next] == predecessorBegin[next] || predecessor[fill_pos[next] - 1] != s) predecessor[fill_pos[next]++] = s;
+			}
+	// the duplicates left gaps, close them
+	int out = 0;
+	for (int s = 0; s<num_states; s++) {
+		int begin = predecessorBegin[s];
+		predecessorBegin[s] = out;
+		for (int p = begin; p<fill_pos[s]; p++) predecessor[out++] = predecessor[p];
+	}
+	predecessorBegin[num_states] = out;
+	predecessor.resize(out);
+	world.assign(num_states, 0);
 }
 
-void draw_image(vector<vector<double>>& world_to_draw)
+void draw_image(vector<double>& world_to_draw)
 {
 	cout << "==================================================" << endl;
-	for (int i = 0; i<WORLD_SIZE; i++) {
+	for (int i = 0; i<world_size; i++) {
 		cout << "|";
-		for (int j = 0; j<WORLD_SIZE; j++) {
-			cout << " " << fixed << setprecision(2) << world_to_draw[i][j] << " |";
+		for (int j = 0; j<world_size; j++) {
+			cout << " " << fixed << setprecision(2) << world_to_draw[state_index(make_pair(i, j))] << " |";
 		}
 		cout << endl;
 	}
 	cout << "==================================================" << endl;
 }
 
-// for figure 3.5
-void cal_random_state_values()
+// How the values are swept: Jacobi sweeps back up every state from the values of the previous sweep,
+// Gauss-Seidel sweeps back up in place so a state already sees this sweep's values of the states
+// before it, and prioritized sweeping backs up one state at a time, always the one with the largest
+// Bellman error, and then recomputes the errors of its predecessors only.
+enum SweepMode { JACOBI, GAUSS_SEIDEL, PRIORITIZED };
+
+// Max-heap of states by their Bellman error, which knows where each state sits, so a state whose error
+// grows moves up in place instead of being queued again
+class ErrorQueue
+{
+private:
+	const vector<double>& error_;
+	vector<int> heap_, position_; // position_ is -1 for a state not queued
+	void place(int i, int s) { heap_[i] = s; position_[s] = i; }
+	void up(int i) {
+		int s = heap_[i];
+		for (; i>0 && error_[heap_[(i - 1) / 2]] < error_[s]; i = (i - 1) / 2) place(i, heap_[(i - 1) / 2]);
+		place(i, s);
+	}
+	void down(int i) {
+		int s = heap_[i], n = (int)heap_.size();
+		for (int child; (child = 2 * i + 1)<n; i = child) {
+			if (child + 1<n && error_[heap_[child + 1]] > error_[heap_[child]]) child++;
+			if (error_[heap_[child]] <= error_[s]) break;
+			place(i, heap_[child]);
+		}
+		place(i, s);
+	}
+public:
+	ErrorQueue(const vector<double>& error) : error_(error), position_(error.size(), -1) {}
+	inline bool empty() const { return heap_.empty(); }
+	// queues s, or moves it up after its error grew
+	void raise(int s) {
+		if (position_[s] < 0) {
+			heap_.push_back(s);
+			position_[s] = (int)heap_.size() - 1;
+		}
+		up(position_[s]);
+	}
+	// removes and returns the state with the largest error
+	int pop() {
+		int top = heap_[0], last = heap_.back();
+		heap_.pop_back();
+		position_[top] = -1;
+		if (!heap_.empty()) {
+			place(0, last);
+			down(0);
+		}
+		return top;
+	}
+};
+
+SweepMode sweep_mode = JACOBI;
+double theta = 1e-4; // sweeps end once the values changed by less than theta in total
+long long backups = 0;
+
+// Bellman backup of state s from values: the expectation under actionProb, or the maximum over actions
+inline double backup(int s, const vector<double>& values, bool optimal)
+{
+	const int* next = &nextState[size_t(s) * NUM_ACTIONS];
+	const double* reward = &actionReward[size_t(s) * NUM_ACTIONS];
+	backups++;
+	if (optimal) {
+		// Bellman optimility equation for state value function
+		double max_value = -numeric_limits<double>::max();
+		for (int a = 0; a<NUM_ACTIONS; a++) max_value = max(max_value, reward[a] + discount * values[next[a]]);
+		return max_value;
+	}
+	// Bellman equation for state value function
+	const double* prob = &actionProb[size_t(s) * NUM_ACTIONS];
+	double value = 0;
+	for (int a = 0; a<NUM_ACTIONS; a++) value += prob[a] * (reward[a] + discount * values[next[a]]);
+	return value;
+}
+
+// Values of the random policy or the optimal ones into world, swept by sweep_mode. The small worlds of
+// the book print every sweep and the values.
+void solve(const string& name, bool optimal)
 {
-	double delta = 1e8;
-	while (delta>1e-4) {
-		delta = 0;
-		vector<vector<double>> new_world(WORLD_SIZE, vector<double>(WORLD_SIZE, 0));
-		for (int i = 0; i<WORLD_SIZE; i++) {
-			for (int j = 0; j<WORLD_SIZE; j++) {
-				for (auto &action : actions) {
-					auto newPosition = nextState[i][j][action];
-					// Bellman equation for state value function
-					new_world[i][j] += actionProb[i][j][action] * (actionReward[i][j][action] + discount * world[newPosition.first][newPosition.second]);
+	bool verbose = world_size <= 10;
+	fill(world.begin(), world.end(), 0.0);
+	backups = 0;
+	int sweeps = 0;
+	auto start = chrono::steady_clock::now();
+	if (sweep_mode == PRIORITIZED) {
+		// A state is queued with its Bellman error when that exceeds theta / num_states, so the errors
+		// left over all states are below theta like the change of the last sweep. A queued state keeps
+		// the largest error it had since its last backup.
+		double tolerance = theta / num_states;
+		vector<double> error(num_states, 0);
+		ErrorQueue queue(error);
+		for (int s = 0; s<num_states; s++) {
+			if (obstacle[s]) continue;
+			error[s] = abs(backup(s, world, optimal) - world[s]);
+			if (error[s] > tolerance) queue.raise(s);
+		}
+		while (!queue.empty()) {
+			int s = queue.pop();
+			world[s] = backup(s, world, optimal);
+			error[s] = 0;
+			for (int p = predecessorBegin[s]; p<predecessorBegin[s + 1]; p++) {
+				int pred = predecessor[p];
+				double e = abs(backup(pred, world, optimal) - world[pred]);
+				if (e > tolerance && e > error[pred]) {
+					error[pred] = e;
+					queue.raise(pred);
 				}
-				delta += abs(new_world[i][j] - world[i][j]);
 			}
 		}
-		world = move(new_world);
-		cout << "Random Policy: delta=" << delta << endl;
 	}
-	cout << "Random Policy" << endl;
-	draw_image(world);
+	else {
+		vector<double> new_world(sweep_mode == JACOBI ? num_states : 0);
+		double delta = 1e8;
+		while (delta>theta) {
+			delta = 0;
+			for (int s = 0; s<num_states; s++) {
+				if (obstacle[s]) continue;
+				double value = backup(s, world, optimal);
+				delta += abs(value - world[s]);
+				if (sweep_mode == JACOBI) new_world[s] = value;
+				else world[s] = value;
+			}
+			if (sweep_mode == JACOBI) world.swap(new_world);
+			sweeps++;
+			if (verbose) cout << name << ": delta=" << delta << endl;
+		}
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << name << endl;
+	if (verbose) draw_image(world);
+	auto precision = cout.precision(4);
+	cout << name << ": ";
+	if (sweep_mode != PRIORITIZED) cout << sweeps << " sweeps, ";
+	cout << backups << " backups, " << seconds << " s, max value "
+		<< *max_element(world.begin(), world.end()) << endl;
+	cout.precision(precision);
+}
+
+// for figure 3.5
+void cal_random_state_values()
+{
+	solve("Random Policy", false);
 }
 
 // for figure 3.8
 void cal_optimal_state_values()
 {
-	// reset world
-	world = vector<vector<double>>(WORLD_SIZE, vector<double>(WORLD_SIZE, 0));
-	double delta = 1e8;
-	while (delta>1e-4) {
-		delta = 0;
-		vector<vector<double>> new_world(WORLD_SIZE, vector<double>(WORLD_SIZE, 0));
-		for (int i = 0; i<WORLD_SIZE; i++) {
-			for (int j = 0; j<WORLD_SIZE; j++) {
-				double max_value = -numeric_limits<double>::max();
-				for (auto &action : actions) {
-					auto newPosition = nextState[i][j][action];
-					// Bellman optimility equation for state value function
-					double state_value = actionReward[i][j][action] + discount * world[newPosition.first][newPosition.second];
-					max_value = max(max_value, state_value);
-				}
-				new_world[i][j] = max_value;
-				delta += abs(new_world[i][j] - world[i][j]);
+	solve("Optimal Policy", true);
+}
+
+// cell (i, j) inside the world, from "i,j"
+bool parse_cell(const char* text, pair<int, int>& cell)
+{
+	return sscanf(text, "%d,%d", &cell.first, &cell.second) == 2 && cell.first >= 0 && cell.first<world_size
+		&& cell.second >= 0 && cell.second<world_size;
+}
+
+int main(int argc, char* argv[])
+{
+	vector<SpecialCell> given_specials;
+	vector<string> special_args, obstacle_args;
+	double obstacle_fraction = 0;
+	unsigned seed = 0;
+	for (int i = 1; i<argc; i++) {
+		string arg = argv[i];
+		if (arg == "--size" && i + 1<argc) world_size = max(2, atoi(argv[++i]));
+		else if (arg == "--special" && i + 1<argc) special_args.push_back(argv[++i]);
+		else if (arg == "--obstacle" && i + 1<argc) obstacle_args.push_back(argv[++i]);
+		else if (arg == "--obstacles" && i + 1<argc) obstacle_fraction = atof(argv[++i]);
+		else if (arg == "--seed" && i + 1<argc) seed = (unsigned)atoi(argv[++i]);
+		else if (arg == "--theta" && i + 1<argc) theta = atof(argv[++i]);
+		else if (arg == "--sweep" && i + 1<argc) {
+			string mode = argv[++i];
+			if (mode == "jacobi") sweep_mode = JACOBI;
+			else if (mode == "gauss-seidel") sweep_mode = GAUSS_SEIDEL;
+			else if (mode == "prioritized") sweep_mode = PRIORITIZED;
+			else {
+				cout << "Unknown sweep " << mode << ", use jacobi, gauss-seidel or prioritized" << endl;
+				return 1;
 			}
 		}
-		world = move(new_world);
-		cout << "Optimal Policy: delta=" << delta << endl;
 	}
-	cout << "Optimal Policy" << endl;
-	draw_image(world);
-}
+	if (world_size * (long long)world_size > numeric_limits<int>::max() / NUM_ACTIONS) {
+		cout << "World size " << world_size << " is too large" << endl;
+		return 1;
+	}
+	num_states = world_size * world_size;
+	for (auto &text : special_args) {
+		SpecialCell special;
+		const char* to = strchr(text.c_str(), ':');
+		if (!to || !parse_cell(text.c_str(), special.from) || !parse_cell(to + 1, special.to)
+			|| !strchr(to + 1, '=') || sscanf(strchr(to + 1, '=') + 1, "%lf", &special.reward) != 1) {
+			cout << "Bad special cell " << text << ", expected i,j:i2,j2=reward inside the world" << endl;
+			return 1;
+		}
+		given_specials.push_back(special);
+	}
+	if (!special_args.empty()) specials = given_specials;
+	for (auto &special : specials) {
+		auto outside = [](pair<int, int> cell) { return cell.first >= world_size || cell.second >= world_size; };
+		if (outside(special.from)) {
+			cout << "Special cell (" << special.from.first << "," << special.from.second << ") is outside the world, give --special" << endl;
+			return 1;
+		}
+		if (outside(special.to)) {
+			cout << "Target (" << special.to.first << "," << special.to.second << ") of special cell (" << special.from.first << ","
+				<< special.from.second << ") is outside the world, give --special" << endl;
+			return 1;
+		}
+	}
+
+	// special cells and their targets have to stay open
+	vector<char> special_cell(num_states, 0);
+	for (auto &special : specials) special_cell[state_index(special.from)] = special_cell[state_index(special.to)] = 1;
+	obstacle.assign(num_states, 0);
+	for (auto &text : obstacle_args) {
+		pair<int, int> cell;
+		if (!parse_cell(text.c_str(), cell)) {
+			cout << "Bad obstacle " << text << ", expected i,j inside the world" << endl;
+			return 1;
+		}
+		if (special_cell[state_index(cell)]) {
+			cout << "Obstacle " << text << " is a special cell or the target of one" << endl;
+			return 1;
+		}
+		obstacle[state_index(cell)] = 1;
+	}
+	if (obstacle_fraction > 0) {
+		// every cell draws, so the obstacles drawn do not depend on where the special cells are
+		default_random_engine engine(seed);
+		bernoulli_distribution blocked(min(obstacle_fraction, 1.0));
+		for (int s = 0; s<num_states; s++)
+			if (blocked(engine) && !special_cell[s]) obstacle[s] = 1;
+	}
 
-int main()
-{
 	states_reward();
 	cal_random_state_values();
 	cal_optimal_state_values();